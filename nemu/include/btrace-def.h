@@ -0,0 +1,81 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __BTRACE_DEF_H__
+#define __BTRACE_DEF_H__
+
+#include <stdint.h>
+
+/* The binary instruction trace written with CONFIG_BTRACE and decoded by
+ * tools/trace-dump.
+ *
+ * The file starts with a BTraceHeader, followed by blocks. Each block is a
+ * BTraceBlock and `comp_size` bytes of its records compressed by zlib.
+ * Blocks are decoded independently, the previous pc and memory address
+ * being 0 at the start of each of them. A record is
+ *
+ *   uint8_t  ilen | nr_mem << 4 | BTRACE_R_GAP
+ *   varint   instructions skipped before this one, only with BTRACE_R_GAP
+ *   varint   zigzag(pc - the pc following the previous record)
+ *   uint8_t  inst[ilen]
+ *   nr_mem times:
+ *     uint8_t  len | BTRACE_M_WRITE
+ *     varint   zigzag(addr - the previous memory address)
+ *
+ * so that a sequential instruction without memory access costs ilen + 2
+ * bytes before compression. */
+
+#define BTRACE_MAGIC "NEMUBTR1"
+
+enum { BTRACE_F_MEM = 1 };  // memory addresses are recorded
+
+typedef struct {
+  char magic[8];
+  uint32_t flags;
+  uint32_t word_size;
+  char triple[32];  // to disassemble the instructions, empty if not supported
+} BTraceHeader;
+
+typedef struct {
+  uint64_t first_inst;  // index of the first instruction
+  uint64_t last_inst;   // index of the last instruction
+  uint32_t raw_size;
+  uint32_t comp_size;
+} BTraceBlock;
+
+#define BTRACE_R_GAP   0x80
+#define BTRACE_MAX_MEM 7
+#define BTRACE_M_WRITE 0x80
+
+static inline uint8_t *btrace_put_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) { *p ++ = v | 0x80; v >>= 7; }
+  *p ++ = v;
+  return p;
+}
+
+static inline const uint8_t *btrace_get_varint(const uint8_t *p, uint64_t *v) {
+  uint64_t ret = 0;
+  for (int shift = 0; ; shift += 7) {
+    ret |= (uint64_t)(*p & 0x7f) << shift;
+    if (!(*p ++ & 0x80)) break;
+  }
+  *v = ret;
+  return p;
+}
+
+static inline uint64_t btrace_zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+static inline int64_t btrace_unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+#endif
@@ -26,4 +26,7 @@ void invalid_inst(vaddr_t thispc);
 #define NEMUTRAP(thispc, code) set_nemu_state(NEMU_END, thispc, code)
 #define INV(thispc) invalid_inst(thispc)
 
+// devices are polled once per this many instructions, by every engine
+#define DEVICE_UPDATE_MASK 0xff
+
 #endif
@@ -105,24 +105,94 @@ finish:
   *shift = __shift;
 }
 
+// --- pattern dispatch table ---
+// Patterns are registered in their order of appearance when the decoder runs
+// for the first time. Then for each bucket of instructions sharing the same
+// dispatch bits (INSTPAT_DISPATCH_MASK, defined by the ISA), the first pattern
+// which may match is recorded. Decoding jumps to this pattern directly, since
+// all the patterns before it can never match. The ISA should choose dispatch
+// bits (e.g. opcode and function fields) which tell most patterns apart, so
+// that the first candidate usually hits.
+#define NR_INSTPAT 256
+
+typedef struct
+{
+  int nr_pat;
+  struct
+  {
+    uint64_t key, mask;
+    const void *label;
+  } pat[NR_INSTPAT];
+  const void **start; // indexed by INSTPAT_DISPATCH(inst), NULL before building
+} InstpatTable;
+
+void instpat_add(InstpatTable *t, uint64_t key, uint64_t mask, const void *label);
+void instpat_build(InstpatTable *t, uint64_t dispatch_mask, const void *end);
+uint64_t instpat_pdep(uint64_t idx, uint64_t mask);
+
+// --- dynamic instruction mix ---
+// Each INSTPAT line has a counter of its own, which is registered with the
+// name of the pattern together with the pattern. INSTPAT_MATCH() should put
+// INSTPAT_COUNT() at the beginning of the execute body.
+#ifdef CONFIG_IMIX
+void imix_add(const char *name, uint64_t *count);
+// print the counts summed by name, hottest first
+void imix_report();
+#define INSTPAT_COUNTER concat(__instpat_count_, __LINE__)
+#define INSTPAT_COUNTER_DEF() static uint64_t INSTPAT_COUNTER = 0
+#define INSTPAT_COUNTER_ADD(name, ...) imix_add(#name, &INSTPAT_COUNTER)
+#define INSTPAT_COUNT() (INSTPAT_COUNTER++)
+#else
+#define INSTPAT_COUNTER_DEF()
+#define INSTPAT_COUNTER_ADD(...)
+#define INSTPAT_COUNT()
+#endif
+
 // --- pattern matching wrappers for decode ---
-#define INSTPAT(pattern, ...)                                      \
-  do                                                               \
-  {                                                                \
-    uint64_t key, mask, shift;                                     \
-    pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
-    if ((((uint64_t)INSTPAT_INST(s) >> shift) & mask) == key)      \
-    {                                                              \
-      INSTPAT_MATCH(s, ##__VA_ARGS__);                             \
-      goto *(__instpat_end);                                       \
-    }                                                              \
+#define INSTPAT(pattern, ...)                                                                 \
+  do                                                                                          \
+  {                                                                                           \
+    INSTPAT_COUNTER_DEF();                                                                    \
+  concat(__instpat_try_, __LINE__):;                                                          \
+    uint64_t key, mask, shift;                                                                \
+    pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift);                            \
+    if (unlikely(__instpat_tbl.start == NULL))                                                \
+    {                                                                                         \
+      instpat_add(&__instpat_tbl, key << shift, mask << shift, &&concat(__instpat_try_, __LINE__)); \
+      INSTPAT_COUNTER_ADD(__VA_ARGS__);                                                       \
+    }                                                                                         \
+    else if ((((uint64_t)INSTPAT_INST(s) >> shift) & mask) == key)                            \
+    {                                                                                         \
+      INSTPAT_MATCH(s, ##__VA_ARGS__);                                                        \
+      goto *(__instpat_end);                                                                  \
+    }                                                                                         \
   } while (0)
 
-#define INSTPAT_START(name) \
-  {                         \
-    const void **__instpat_end = &&concat(__instpat_end_, name);
-#define INSTPAT_END(name)         \
-  concat(__instpat_end_, name) :; \
+// a label unique to each INSTPAT line, the ISA may put it in front of the
+// execute body to jump there directly (see the decode cache)
+#define INSTPAT_LABEL concat(__instpat_exec_, __LINE__)
+
+#define INSTPAT_START(name)                                                      \
+  {                                                                              \
+    static const void *__instpat_end = &&concat(__instpat_end_, name);           \
+    static InstpatTable __instpat_tbl = {};                                      \
+    if (likely(__instpat_tbl.start != NULL))                                     \
+    {                                                                            \
+      goto *(__instpat_tbl.start[INSTPAT_DISPATCH(INSTPAT_INST(s))]);            \
+    }
+
+#define INSTPAT_END(name)                                                        \
+    if (__instpat_tbl.start == NULL)                                             \
+    {                                                                            \
+      instpat_build(&__instpat_tbl, INSTPAT_DISPATCH_MASK, __instpat_end);       \
+      for (uint64_t i = 0; i < (1ull << __builtin_popcountll(INSTPAT_DISPATCH_MASK)); i++) \
+      {                                                                          \
+        Assert(INSTPAT_DISPATCH(instpat_pdep(i, INSTPAT_DISPATCH_MASK)) == i,    \
+               "INSTPAT_DISPATCH() does not agree with INSTPAT_DISPATCH_MASK");  \
+      }                                                                          \
+      goto *(__instpat_tbl.start[INSTPAT_DISPATCH(INSTPAT_INST(s))]);            \
+    }                                                                            \
+  concat(__instpat_end_, name) :;                                                \
   }
 
 #endif
@@ -0,0 +1,72 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#ifndef __CPU_ICACHE_H__
+#define __CPU_ICACHE_H__
+
+#include <common.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+// A direct-mapped cache of decoded instructions, indexed by guest pc.
+// Each entry remembers the result of decode_operand() together with the
+// address of the execute body selected by the INSTPAT chain, so that a hit
+// skips both the instruction fetch and the pattern matching.
+// The threaded engine uses the same entries as its micro-ops.
+
+#define ICACHE_BITS 16
+#define ICACHE_SIZE (1 << ICACHE_BITS)
+
+typedef struct ICacheEntry
+{
+  vaddr_t pc;
+  uint32_t inst;
+  const void *handler; // label of the execute body in decode_exec(), NULL if invalid
+  uint8_t rd, rs1, rs2;
+  word_t imm;
+} ICacheEntry;
+
+extern ICacheEntry icache[ICACHE_SIZE];
+extern uint8_t icache_page[CONFIG_MSIZE / PAGE_SIZE];
+
+static inline ICacheEntry *icache_entry(vaddr_t pc)
+{
+  return &icache[(pc >> 2) & (ICACHE_SIZE - 1)];
+}
+
+// remember that the page of `pc` holds cached instructions,
+// writes to it should go through paddr_write() to be seen
+static inline void icache_mark_page(vaddr_t pc)
+{
+  if (in_pmem(pc) && !icache_page[(pc - CONFIG_MBASE) >> PAGE_SHIFT])
+  {
+    icache_page[(pc - CONFIG_MBASE) >> PAGE_SHIFT] = 1;
+    paddr_protect_page(pc, true);
+  }
+}
+
+void icache_invalidate(paddr_t addr, int len);
+void icache_flush();
+
+// called by paddr_write(), only pages holding cached code pay for the invalidation
+static inline void icache_check_write(paddr_t addr, int len)
+{
+  if (unlikely(icache_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT]))
+  {
+    icache_invalidate(addr, len);
+  }
+}
+
+#endif
@@ -34,15 +34,40 @@ static inline bool map_inside(IOMap *map, paddr_t addr) {
   return (addr >= map->low && addr <= map->high);
 }
 
-static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
-  int i;
-  for (i = 0; i < size; i ++) {
-    if (map_inside(maps + i, addr)) {
-      difftest_skip_ref();
-      return i;
-    }
+// An index of the maps in an address space, which finds the map of an
+// address in constant time no matter how many maps are added. It is a
+// two-level table of pages. A page covered by a single map points to it,
+// while a page shared by several maps points to the map of each byte.
+#define IO_PAGE_SHIFT 12
+#define IO_DIR_SHIFT  22
+
+typedef struct {
+  IOMap *map;
+  IOMap **byte;
+} IOPage;
+
+typedef struct {
+  IOMap **maps;  // in the order they are added
+  int nr_map;
+  IOMap *last;   // the map hit last time, checked before the table
+  IOPage *dir[1 << (32 - IO_DIR_SHIFT)];
+} IOMapIndex;
+
+IOMap* add_map(IOMapIndex *idx, IOMap map);
+
+static inline IOMap* find_map_by_addr(IOMapIndex *idx, paddr_t addr) {
+  IOMap *map = idx->last;
+  if (map == NULL || !map_inside(map, addr)) {
+    if ((uint64_t)addr >> 32) { return NULL; }
+    IOPage *dir = idx->dir[addr >> IO_DIR_SHIFT];
+    if (dir == NULL) { return NULL; }
+    IOPage *page = &dir[(addr >> IO_PAGE_SHIFT) & ((1 << (IO_DIR_SHIFT - IO_PAGE_SHIFT)) - 1)];
+    map = (page->byte == NULL ? page->map : page->byte[addr & ((1 << IO_PAGE_SHIFT) - 1)]);
+    if (map == NULL) { return NULL; }
+    idx->last = map;
   }
-  return -1;
+  difftest_skip_ref();
+  return map;
 }
 
 void add_pio_map(const char *name, ioaddr_t addr,
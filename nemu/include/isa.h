@@ -36,6 +36,10 @@ word_t isa_reg_str2val(const char *name, bool *success);
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+// pre-decoded execution for the threaded engine, see <cpu/icache.h>
+struct ICacheEntry;
+bool isa_decode_once(struct Decode *s, struct ICacheEntry *op, bool *direct);
+int isa_exec_ops(struct Decode *s, struct ICacheEntry *ops, int nr_op);
 
 // memory
 enum
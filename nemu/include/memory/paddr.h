@@ -17,6 +17,7 @@
 #define __MEMORY_PADDR_H__
 
 #include <common.h>
+#include <memory/vaddr.h>
 
 #define PMEM_LEFT  ((paddr_t)CONFIG_MBASE)
 #define PMEM_RIGHT ((paddr_t)CONFIG_MBASE + CONFIG_MSIZE - 1)
@@ -34,4 +35,61 @@ static inline bool in_pmem(paddr_t addr) {
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+/* make the pages of pmem in [addr, addr + len) ready for the host to access through guest_to_host() */
+void paddr_touch(paddr_t addr, uint64_t len);
+/* load `len` bytes of the file `fd` at `off` to pmem at `addr`, the whole pages
+ * are mapped from the file without copying when pmem is mmap()ed, and become
+ * private to this process once written */
+void paddr_load_file(paddr_t addr, uint64_t len, int fd, uint64_t off);
+/* clear [addr, addr + len) of pmem, the whole pages are only allocated when touched */
+void paddr_zero(paddr_t addr, uint64_t len);
+/* map the guest pages fully covered by [addr, addr + len) to host memory for direct access */
+void paddr_map_host(paddr_t addr, uint64_t len, uint8_t *host);
+/* let writes to a page go through paddr_write() or not, e.g. when it holds cached code */
+void paddr_protect_page(paddr_t addr, bool protect);
+
+#ifdef CONFIG_CHECKPOINT
+/* whether the page of pmem at `addr` is written since the last paddr_clean() */
+bool paddr_page_dirty(paddr_t addr);
+/* whether the page of pmem at `addr` has contents, only false for the pages
+ * untouched with CONFIG_MEM_RANDOM */
+bool paddr_page_ready(paddr_t addr);
+/* mark all the pages of pmem clean */
+void paddr_clean();
+/* drop the contents of pmem, as if it is just initialized */
+void paddr_reset();
+#endif
+
+#ifndef PMEM64
+/* The host address of each guest page which is accessed directly, i.e. a page
+ * of pmem or a page of device memory without callback. NULL means the access
+ * should go through paddr_read()/paddr_write(). */
+#define NR_PPAGE (1ul << (32 - PAGE_SHIFT))
+extern uint8_t *ppage_r[NR_PPAGE];
+extern uint8_t *ppage_w[NR_PPAGE];
+#endif
+
+#ifdef CONFIG_PMEM_GUARD
+/* The whole 32-bit physical space is reserved at guard_base. Pages of pmem are
+ * accessible at their offset once touched, and the others are left PROT_NONE,
+ * so that reads from them fault and are emulated by the SIGSEGV handler.
+ * One more PROT_NONE page is reserved after it, where a read crossing the end
+ * of the space faults as well. */
+#define GUARD_SIZE (1ull << 32)
+#define GUARD_MAP_SIZE (GUARD_SIZE + PAGE_SIZE)
+extern uint8_t *guard_base;
+#endif
+
+/* return the host address to access `len` bytes at `addr` directly, or NULL */
+static inline uint8_t* ppage_host(uint64_t addr, int len, bool is_write) {
+#ifdef PMEM64
+  return NULL;
+#else
+  if (addr >> 32) return NULL;
+  uint8_t *page = (is_write ? ppage_w : ppage_r)[addr >> PAGE_SHIFT];
+  if (page == NULL || (addr & PAGE_MASK) + len > PAGE_SIZE) return NULL;
+  return page + (addr & PAGE_MASK);
+#endif
+}
+
 #endif
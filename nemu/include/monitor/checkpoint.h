@@ -0,0 +1,35 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __MONITOR_CHECKPOINT_H__
+#define __MONITOR_CHECKPOINT_H__
+
+#include <common.h>
+
+#ifdef CONFIG_CHECKPOINT
+// Save the whole machine to `file`. It only holds the pages written since
+// the last checkpoint saved or restored, which becomes its parent. The pages
+// are compressed unless `raw`, then they are mapped from the file instead.
+bool ckpt_save(const char *file, bool raw);
+bool ckpt_restore(const char *file);
+// the state private to a device besides its space from new_space(),
+// `restore` is called after it is restored if not NULL
+void ckpt_register(const char *name, void *ptr, size_t size, void (*restore)());
+// the number of instructions to save the checkpoint of --checkpoint at
+extern uint64_t ckpt_next;
+void ckpt_reach();
+#endif
+
+#endif
@@ -0,0 +1,38 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __MONITOR_REVERSE_H__
+#define __MONITOR_REVERSE_H__
+
+#include <common.h>
+
+#ifdef CONFIG_REVERSE
+// the number of instructions to take the next snapshot at, or to stop at
+// after going back
+extern uint64_t rev_next;
+// return true in a snapshot just resumed, which runs on to where it goes back
+bool rev_reach();
+// called when a watchpoint changes, return true to go on running
+bool rev_watch_hit();
+// go back `n` instructions
+void rev_step_back(uint64_t n);
+// go back to the last change of a watchpoint, or the earliest snapshot
+void rev_continue();
+void rev_info();
+// drop the snapshots, e.g. after a checkpoint is restored
+void rev_reset();
+#endif
+
+#endif
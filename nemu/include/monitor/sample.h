@@ -0,0 +1,30 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __MONITOR_SAMPLE_H__
+#define __MONITOR_SAMPLE_H__
+
+#include <common.h>
+
+#ifdef CONFIG_SAMPLE
+// the number of instructions to fork the next worker at in the driver,
+// or to end the interval at in a worker
+extern uint64_t sample_next;
+extern bool sample_worker;
+void sample_reach();
+void sample_finish();
+#endif
+
+#endif
@@ -33,6 +33,8 @@ extern NEMUState nemu_state;
 // ----------- timer -----------
 
 uint64_t get_time();
+// let get_time() go on from `us`, e.g. after a checkpoint is restored
+void set_time(uint64_t us);
 
 // ----------- log -----------
 
@@ -58,20 +60,65 @@ uint64_t get_time();
 
 #define log_write(...) IFDEF(CONFIG_TARGET_NATIVE_ELF, \
   do { \
-    extern FILE* log_fp; \
     extern bool log_enable(); \
     if (log_enable()) { \
-      fprintf(log_fp, __VA_ARGS__); \
-      fflush(log_fp); \
+      log_printf(__VA_ARGS__); \
     } \
   } while (0) \
 )
 
+#ifdef CONFIG_TARGET_NATIVE_ELF
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+// write all the log lines so far to the log file
+void log_flush();
+// called in a forked child, which writes the log to the file with `suffix`,
+// or to the same file when it is NULL
+void log_fork(const char *suffix);
+#endif
+
 #define _Log(...) \
   do { \
     printf(__VA_ARGS__); \
     log_write(__VA_ARGS__); \
   } while (0)
 
+// ----------- itrace -----------
+
+#ifdef CONFIG_ITRACE
+#define ITRACE_ILEN_MAX MUXDEF(CONFIG_ISA_x86, 8, 4)
+
+// format the pc, the bytes and the disassembly of an instruction
+void itrace_format(char *buf, int size, vaddr_t pc, const uint8_t *inst, int ilen);
+#endif
+
+#ifdef CONFIG_IQUEUE
+// A ring of the instructions traced recently. Recording one only copies
+// its raw bytes, and the disassembly is left to iqueue_dump(). The pc is
+// recorded before the instruction runs and the bytes after it, so the one
+// NEMU fails in is in the ring with ilen = 0.
+typedef struct {
+  vaddr_t pc;
+  uint8_t ilen;
+  uint8_t inst[ITRACE_ILEN_MAX];
+} IQueueEntry;
+
+extern IQueueEntry iqueue[CONFIG_IQUEUE_SIZE];
+extern uint64_t iqueue_nr;
+
+static inline void iqueue_begin(vaddr_t pc) {
+  IQueueEntry *e = &iqueue[iqueue_nr ++ & (CONFIG_IQUEUE_SIZE - 1)];
+  e->pc = pc;
+  e->ilen = 0;
+}
+
+static inline void iqueue_commit(const uint8_t *inst, int ilen) {
+  IQueueEntry *e = &iqueue[(iqueue_nr - 1) & (CONFIG_IQUEUE_SIZE - 1)];
+  e->ilen = ilen;
+  memcpy(e->inst, inst, ITRACE_ILEN_MAX);
+}
+
+void iqueue_dump();
+#endif
+
 
 #endif
@@ -0,0 +1,31 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __UTILS_BTRACE_H__
+#define __UTILS_BTRACE_H__
+
+#include <common.h>
+
+#ifdef CONFIG_BTRACE
+// the binary trace file, see btrace-def.h
+extern bool btrace_on;
+void btrace_inst(uint64_t nr_inst, vaddr_t pc, const uint8_t *inst, int ilen);
+void btrace_mem(vaddr_t addr, int len, bool is_write);
+void btrace_close();
+// called in a forked child, the trace file is left to the parent
+void btrace_fork();
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __UTILS_SYMTAB_H__
+#define __UTILS_SYMTAB_H__
+
+#include <common.h>
+
+#ifdef CONFIG_SYMTAB
+// the functions in the symbol table of the ELF image, added while it is
+// loaded and then sorted by address
+typedef struct {
+  vaddr_t lo, hi;
+  char *name;
+} FuncSym;
+
+extern FuncSym *symtab;
+extern int nr_symtab;
+
+void symtab_add(vaddr_t addr, word_t size, const char *name);
+void symtab_build();
+// the function holding `pc`, or -1
+int symtab_lookup(vaddr_t pc);
+// "??" for -1
+const char *symtab_name(int func);
+#endif
+
+#endif
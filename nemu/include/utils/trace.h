@@ -0,0 +1,61 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __UTILS_TRACE_H__
+#define __UTILS_TRACE_H__
+
+#include <common.h>
+
+#ifdef CONFIG_TRACE
+// The trace is recorded while it is on and the number of instructions
+// executed is in [trace_start, trace_end]. These are set from the command
+// line or sdb, and SIGUSR2 turns the trace on and off.
+extern volatile bool trace_on;
+extern uint64_t trace_start, trace_end;
+
+static inline bool trace_active(uint64_t nr_inst) {
+  return trace_on && nr_inst >= trace_start && nr_inst <= trace_end;
+}
+
+// how many instructions after the `nr_inst`-th one can run before the
+// trace may turn on or off, and whether it is active for them
+uint64_t trace_next_edge(uint64_t nr_inst, bool *active);
+
+// The pc filters are looked up for the interval of pcs around the last
+// instruction checked, and inside it the answer stays the same. So they are
+// checked for each instruction with two compares, which costs as little as
+// a check per block and stays exact when a range ends inside a block.
+typedef struct {
+  vaddr_t lo, hi;
+  bool ok;
+} TraceBlock;
+
+extern TraceBlock trace_block;
+bool trace_pc_lookup(vaddr_t pc);
+
+static inline bool trace_pc_ok(vaddr_t pc) {
+  if (likely(pc >= trace_block.lo && pc <= trace_block.hi)) return trace_block.ok;
+  return trace_pc_lookup(pc);
+}
+
+// "START,END" or "START,+COUNT"
+bool trace_set_window(const char *arg);
+// "LO,HI", the pcs in [LO, HI) are traced
+bool trace_add_pc_range(const char *arg);
+void trace_clear_pc_range();
+void trace_display();
+#endif
+
+#endif
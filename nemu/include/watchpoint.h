@@ -25,6 +25,9 @@ typedef struct watchpoint
 WP *new_wp();         // 添加一个监视点
 void free_wp(WP *wp); // 删除一个监视点
 int watchpoint_val(); // 判断所有监视点的值是否发生变化
+bool watchpoint_armed();
+int watchpoint_export(int *no, uint32_t *addr);
+void watchpoint_import(const int *no, const uint32_t *addr, int n);
 int del_watchpoint(int num);
 void print_head_free_();
 void print_watchpoint();
@@ -16,6 +16,12 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <utils/btrace.h>
+#include <utils/trace.h>
+#include <utils/prof.h>
+#include <monitor/checkpoint.h>
+#include <monitor/sample.h>
+#include <monitor/reverse.h>
 #include <locale.h>
 
 // ----------
@@ -33,80 +39,210 @@ CPU_state cpu = {};
 uint64_t g_nr_guest_inst = 0;
 static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
+#ifdef CONFIG_IQUEUE
+// the instruction being executed, to complete its entry in the ring
+static Decode *iqueue_running = NULL;
+#endif
 
 void device_update();
 
-static void trace_and_difftest(Decode *_this, vaddr_t dnpc)
+// Hooks which run after each instruction. The execute loop is specialized
+// for every combination of them, so that a batch run with no hook armed
+// does not pay for checking them.
+enum
+{
+  HOOK_PRINT = 1, // print the instructions executed by `si'
+  HOOK_TRACE = 2, // record the instructions in the window, in the log or the trace file
+  HOOK_DIFFTEST = 4,
+  HOOK_WATCH = 8, // check the watchpoints
+  NR_HOOK_SET = 16
+};
+
+static uint32_t g_hooks = 0;
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// hooks are only armed or disarmed from sdb,
+// so they are checked again at the beginning of each cpu_exec(),
+// except HOOK_TRACE which execute() drops outside the trace window,
+// the ring of CONFIG_IQUEUE records every instruction regardless
+static void update_hooks()
+{
+  g_hooks = 0;
+  if (g_print_step && ISDEF(CONFIG_ITRACE))
+    g_hooks |= HOOK_PRINT;
+#ifdef CONFIG_ITRACE_COND
+  g_hooks |= HOOK_TRACE;
+#endif
+  if (ISDEF(CONFIG_DIFFTEST))
+    g_hooks |= HOOK_DIFFTEST;
+  if (watchpoint_armed())
+    g_hooks |= HOOK_WATCH;
+}
+
+static ALWAYS_INLINE void trace_and_difftest(Decode *_this, vaddr_t dnpc, uint32_t hooks)
 {
+#ifdef CONFIG_IQUEUE
+  // the ring keeps the last instructions before a crash wherever it happens,
+  // so neither the trace window nor the pc filters apply to it
+  iqueue_commit((uint8_t *)&_this->isa.inst.val, _this->snpc - _this->pc);
+#endif
 #ifdef CONFIG_ITRACE_COND
-  if (ITRACE_COND)
+  if ((hooks & HOOK_TRACE) && ITRACE_COND && trace_pc_ok(_this->pc))
   {
-    log_write("%s\n", _this->logbuf);
+    IFNDEF(CONFIG_IQUEUE, log_write("%s\n", _this->logbuf));
+#ifdef CONFIG_BTRACE
+    if (btrace_on)
+    {
+      btrace_inst(g_nr_guest_inst - 1, _this->pc, (uint8_t *)&_this->isa.inst.val, _this->snpc - _this->pc);
+    }
+#endif
   }
 #endif
-  if (g_print_step)
+  if (hooks & HOOK_PRINT)
   {
     IFDEF(CONFIG_ITRACE, puts(_this->logbuf));
   }
-  IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+  if (hooks & HOOK_DIFFTEST)
+  {
+    IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+  }
 
   // -------------
   // 程序每执行一条指令就 扫描一次监视点
   // 扫描所有的监视点  并对监视点相应的表达式求值 若值发生了变化 触发监视点 程序停下来 将nemu_state.state变量设置为NEMU_STOP 打印提示触发监视点 返回sdb_mainloop()
-  int c = watchpoint_val();
-  if (c == 1)
+  if (hooks & HOOK_WATCH)
   {
-    // 值发生了改变
-    nemu_state.state = NEMU_STOP;
-    printf("触发监视点!\n");
+    int c = watchpoint_val();
+    if (c == 1 && !MUXDEF(CONFIG_REVERSE, rev_watch_hit(), false))
+    {
+      // 值发生了改变
+      nemu_state.state = NEMU_STOP;
+      printf("触发监视点!\n");
+    }
   }
 }
 
-static void exec_once(Decode *s, vaddr_t pc)
+static ALWAYS_INLINE void exec_once(Decode *s, vaddr_t pc, uint32_t hooks)
 {
   s->pc = pc;
   s->snpc = pc;
+  IFDEF(CONFIG_IQUEUE, iqueue_begin(pc));
   isa_exec_once(s);
   cpu.pc = s->dnpc;
 #ifdef CONFIG_ITRACE
-  char *p = s->logbuf;
-  p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", s->pc);
-  int ilen = s->snpc - s->pc;
-  int i;
-  uint8_t *inst = (uint8_t *)&s->isa.inst.val;
-  for (i = ilen - 1; i >= 0; i--)
+  // the disassembly is only needed when it is printed or logged,
+  // the ring of CONFIG_IQUEUE disassembles its instructions when dumped
+  if ((hooks & HOOK_PRINT) || (!ISDEF(CONFIG_IQUEUE) && (hooks & HOOK_TRACE) && trace_pc_ok(s->pc)))
   {
-    p += snprintf(p, 4, " %02x", inst[i]);
+    itrace_format(s->logbuf, sizeof(s->logbuf), s->pc, (uint8_t *)&s->isa.inst.val, s->snpc - s->pc);
   }
-  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
-  int space_len = ilen_max - ilen;
-  if (space_len < 0)
-    space_len = 0;
-  space_len = space_len * 3 + 1;
-  memset(p, ' ', space_len);
-  p += space_len;
-
-#ifndef CONFIG_ISA_loongarch32r
-  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
-  disassemble(p, s->logbuf + sizeof(s->logbuf) - p,
-              MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc), (uint8_t *)&s->isa.inst.val, ilen);
-#else
-  p[0] = '\0'; // the upstream llvm does not support loongarch32r
-#endif
 #endif
 }
 
-static void execute(uint64_t n)
+static ALWAYS_INLINE void execute_loop(uint64_t n, uint32_t hooks)
 {
   Decode s;
+  IFDEF(CONFIG_IQUEUE, iqueue_running = &s);
   for (; n > 0; n--)
   {
-    exec_once(&s, cpu.pc);
+    exec_once(&s, cpu.pc, hooks);
     g_nr_guest_inst++;
-    trace_and_difftest(&s, cpu.pc);
+    trace_and_difftest(&s, cpu.pc, hooks);
     if (nemu_state.state != NEMU_RUNNING)
       break;
-    IFDEF(CONFIG_DEVICE, device_update());
+    if ((g_nr_guest_inst & DEVICE_UPDATE_MASK) == 0)
+    {
+      IFDEF(CONFIG_DEVICE, device_update());
+    }
+  }
+  IFDEF(CONFIG_IQUEUE, iqueue_running = NULL);
+}
+
+#define HOOK_SETS(f) f(0) f(1) f(2) f(3) f(4) f(5) f(6) f(7) \
+                     f(8) f(9) f(10) f(11) f(12) f(13) f(14) f(15)
+#define EXECUTE_VARIANT(hooks) \
+  static void concat(execute_, hooks)(uint64_t n) { execute_loop(n, hooks); }
+#define EXECUTE_ENTRY(hooks) concat(execute_, hooks),
+
+HOOK_SETS(EXECUTE_VARIANT)
+static void (*const execute_variant[NR_HOOK_SET])(uint64_t) = {HOOK_SETS(EXECUTE_ENTRY)};
+
+static void execute_hooks(uint64_t n, uint32_t hooks)
+{
+#ifdef CONFIG_ENGINE_TB
+  // the hooks are only available when interpreting instructions one by one,
+  // and so is paging
+  if (hooks == 0)
+  {
+    uint64_t tb_execute(uint64_t n);
+    n = tb_execute(n);
+    if (n == 0 || nemu_state.state != NEMU_RUNNING)
+      return;
+  }
+#endif
+  execute_variant[hooks](n);
+}
+
+// run up to the next edge of the trace window, the next sample or the next
+// checkpoint at a time, without any of them the loop runs once
+static void execute(uint64_t n)
+{
+  while (n > 0 && nemu_state.state == NEMU_RUNNING)
+  {
+#ifdef CONFIG_REVERSE
+    // a snapshot resumed runs until the instruction to go back to,
+    // whatever is left of the command it is taken in
+    if (g_nr_guest_inst == rev_next && rev_reach())
+    {
+      n = UINT64_MAX;
+      g_print_step = false;
+      update_hooks();
+    }
+    if (nemu_state.state != NEMU_RUNNING)
+      break;
+#endif
+    uint64_t chunk = n;
+    uint32_t hooks = g_hooks;
+#ifdef CONFIG_CHECKPOINT
+    if (g_nr_guest_inst == ckpt_next)
+      ckpt_reach();
+    if (ckpt_next - g_nr_guest_inst < chunk)
+      chunk = ckpt_next - g_nr_guest_inst;
+#endif
+#ifdef CONFIG_SAMPLE
+    if (g_nr_guest_inst == sample_next)
+      sample_reach();
+    if (nemu_state.state != NEMU_RUNNING)
+      break;
+    if (sample_next - g_nr_guest_inst < chunk)
+      chunk = sample_next - g_nr_guest_inst;
+#endif
+#ifdef CONFIG_REVERSE
+    if (rev_next - g_nr_guest_inst < chunk)
+      chunk = rev_next - g_nr_guest_inst;
+#endif
+#ifdef CONFIG_TRACE
+    // the instructions outside the trace window do not pay for HOOK_TRACE
+    bool active;
+    uint64_t edge = trace_next_edge(g_nr_guest_inst, &active);
+    if (edge < chunk)
+      chunk = edge;
+    if (!active)
+      hooks &= ~HOOK_TRACE;
+#endif
+#ifdef CONFIG_PROFILE
+    uint64_t to_sample = CONFIG_PROFILE_PERIOD - g_nr_guest_inst % CONFIG_PROFILE_PERIOD;
+    if (to_sample < chunk)
+      chunk = to_sample;
+#endif
+    uint64_t nr_inst = g_nr_guest_inst;
+    execute_hooks(chunk, hooks);
+    n -= g_nr_guest_inst - nr_inst;
+#ifdef CONFIG_PROFILE
+    if (g_nr_guest_inst % CONFIG_PROFILE_PERIOD == 0)
+      prof_sample(cpu.pc);
+#endif
   }
 }
 
@@ -120,18 +256,33 @@ static void statistic()
     Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
   else
     Log("Finish running in less than 1 us and can not calculate the simulation frequency");
+  IFDEF(CONFIG_PROFILE, prof_report());
+  IFDEF(CONFIG_IMIX, imix_report());
 }
 
 void assert_fail_msg()
 {
+#ifdef CONFIG_IQUEUE
+  // the instruction NEMU fails in only has its pc in the ring, add its
+  // bytes if it is fetched
+  Decode *s = iqueue_running;
+  if (s != NULL && iqueue[(iqueue_nr - 1) & (CONFIG_IQUEUE_SIZE - 1)].ilen == 0 && s->snpc != s->pc)
+  {
+    iqueue_commit((uint8_t *)&s->isa.inst.val, s->snpc - s->pc);
+  }
+  iqueue_dump();
+#endif
+  IFDEF(CONFIG_BTRACE, btrace_close());
   isa_reg_display();
   statistic();
+  IFDEF(CONFIG_TARGET_NATIVE_ELF, log_flush());
 }
 
 /* Simulate how the CPU works. */
 void cpu_exec(uint64_t n)
 {
   g_print_step = (n < MAX_INST_TO_PRINT);
+  update_hooks();
   switch (nemu_state.state)
   {
   case NEMU_END:
@@ -145,10 +296,16 @@ void cpu_exec(uint64_t n)
   uint64_t timer_start = get_time();
 
   execute(n);
+  difftest_sync();
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
 
+#ifdef CONFIG_SAMPLE
+  if (sample_worker)
+    sample_finish();
+#endif
+
   switch (nemu_state.state)
   {
   case NEMU_RUNNING:
@@ -160,8 +317,13 @@ void cpu_exec(uint64_t n)
     Log("nemu: %s at pc = " FMT_WORD,
         (nemu_state.state == NEMU_ABORT ? ANSI_FMT("ABORT", ANSI_FG_RED) : (nemu_state.halt_ret == 0 ? ANSI_FMT("HIT GOOD TRAP", ANSI_FG_GREEN) : ANSI_FMT("HIT BAD TRAP", ANSI_FG_RED))),
         nemu_state.halt_pc);
+    if (nemu_state.state == NEMU_ABORT || ISDEF(CONFIG_IQUEUE_DUMP_END))
+    {
+      IFDEF(CONFIG_IQUEUE, iqueue_dump());
+    }
     // fall through
   case NEMU_QUIT:
     statistic();
   }
+  IFDEF(CONFIG_TARGET_NATIVE_ELF, log_flush());
 }
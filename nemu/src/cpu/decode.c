@@ -0,0 +1,163 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#include <cpu/decode.h>
+
+void instpat_add(InstpatTable *t, uint64_t key, uint64_t mask, const void *label)
+{
+  Assert(t->nr_pat < NR_INSTPAT, "too many patterns, please enlarge NR_INSTPAT");
+  t->pat[t->nr_pat].key = key;
+  t->pat[t->nr_pat].mask = mask;
+  t->pat[t->nr_pat].label = label;
+  t->nr_pat++;
+}
+
+// scatter the low bits of `idx` to the positions of the set bits in `mask`
+uint64_t instpat_pdep(uint64_t idx, uint64_t mask)
+{
+  uint64_t ret = 0;
+  for (uint64_t bit = 1; mask != 0; bit <<= 1)
+  {
+    uint64_t low = mask & -mask;
+    if (idx & bit)
+    {
+      ret |= low;
+    }
+    mask ^= low;
+  }
+  return ret;
+}
+
+void instpat_build(InstpatTable *t, uint64_t dispatch_mask, const void *end)
+{
+  uint64_t nr_bucket = 1ull << __builtin_popcountll(dispatch_mask);
+  const void **start = malloc(sizeof(start[0]) * nr_bucket);
+  assert(start);
+
+  for (uint64_t idx = 0; idx < nr_bucket; idx++)
+  {
+    uint64_t bits = instpat_pdep(idx, dispatch_mask);
+    start[idx] = end;
+    for (int i = 0; i < t->nr_pat; i++)
+    {
+      // only the dispatch bits fixed by the pattern can rule it out
+      uint64_t m = t->pat[i].mask & dispatch_mask;
+      if ((bits & m) == (t->pat[i].key & m))
+      {
+        start[idx] = t->pat[i].label;
+        break;
+      }
+    }
+  }
+
+  t->start = start;
+}
+
+#ifdef CONFIG_IMIX
+#define NR_IMIX 1024
+
+static struct
+{
+  const char *name;
+  uint64_t *count;
+} imix[NR_IMIX];
+static int nr_imix = 0;
+
+void imix_add(const char *name, uint64_t *count)
+{
+  Assert(nr_imix < NR_IMIX, "too many patterns, please enlarge NR_IMIX");
+  imix[nr_imix].name = name;
+  imix[nr_imix].count = count;
+  nr_imix++;
+}
+
+typedef struct
+{
+  const char *name;
+  uint64_t count;
+} IMixEntry;
+
+static int imix_cmp(const void *a, const void *b)
+{
+  uint64_t x = ((const IMixEntry *)a)->count, y = ((const IMixEntry *)b)->count;
+  return (x < y) - (x > y);
+}
+
+// the counts of the patterns sharing a name are summed, hottest first
+static int imix_collect(IMixEntry *e, uint64_t *total)
+{
+  int n = 0;
+  *total = 0;
+  for (int i = 0; i < nr_imix; i++)
+  {
+    int j = 0;
+    while (j < n && strcmp(e[j].name, imix[i].name) != 0)
+    {
+      j++;
+    }
+    if (j == n)
+    {
+      e[n++] = (IMixEntry){.name = imix[i].name, .count = 0};
+    }
+    e[j].count += *imix[i].count;
+    *total += *imix[i].count;
+  }
+  qsort(e, n, sizeof(e[0]), imix_cmp);
+  return n;
+}
+
+void imix_report()
+{
+  IMixEntry e[NR_IMIX];
+  uint64_t total;
+  int n = imix_collect(e, &total);
+  if (total == 0)
+  {
+    return;
+  }
+  _Log("dynamic instruction mix:\n");
+  for (int i = 0; i < n && e[i].count > 0; i++)
+  {
+    _Log("  %-12s %14" PRIu64 " %6.2f%%\n", e[i].name, e[i].count, e[i].count * 100.0 / total);
+  }
+}
+
+static const char *imix_file = NULL;
+
+// every pattern, including those never executed, for coverage
+static void imix_dump()
+{
+  FILE *fp = fopen(imix_file, "w");
+  Assert(fp, "Can not open '%s'", imix_file);
+  IMixEntry e[NR_IMIX];
+  uint64_t total;
+  int n = imix_collect(e, &total);
+  fprintf(fp, "name,count\n");
+  for (int i = 0; i < n; i++)
+  {
+    fprintf(fp, "%s,%" PRIu64 "\n", e[i].name, e[i].count);
+  }
+  fclose(fp);
+}
+
+void init_imix(const char *csv_file)
+{
+  if (csv_file != NULL)
+  {
+    imix_file = csv_file;
+    atexit(imix_dump);
+  }
+}
+#endif
@@ -14,12 +14,20 @@
 ***************************************************************************************/
 
 #include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
 #include <utils.h>
 #include <difftest-def.h>
+#include <utils/btrace.h>
+#include <monitor/checkpoint.h>
+#include <monitor/sample.h>
+#include <monitor/reverse.h>
 
 void (*ref_difftest_memcpy)(paddr_t addr, void *buf, size_t n, bool direction) = NULL;
 void (*ref_difftest_regcpy)(void *dut, bool direction) = NULL;
@@ -31,9 +39,77 @@ void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
 
+#ifdef CONFIG_DIFFTEST_BATCH
+// The reference runs the instructions of a batch in one call, and is only
+// compared at the end of the batch. Besides reaching batch_size, a batch is
+// closed early in three cases: by difftest_skip_ref(), by difftest_skip_dut()
+// and by difftest_sync() at the end of cpu_exec(). The state of the DUT after
+// the last instruction counted is kept, since an instruction skipped by the
+// reference closes the batch before itself.
+static uint64_t batch_size = 1, batch_pending = 0;
+static CPU_state batch_prev;
+static vaddr_t batch_prev_pc = 0;
+
+// A copy of NEMU, with the reference inside, forked at the start of a batch
+// and waiting on a pipe. On a mismatch it runs again in lockstep to find the
+// first instruction which differs, and reports it through another pipe.
+typedef struct {
+  bool found;
+  uint64_t nr_inst;
+  vaddr_t pc;
+} ReplayResult;
+
+static pid_t snap_pid = 0, snap_owner = 0;
+static int snap_cmd_fd = -1, snap_result_fd = -1;
+static uint64_t snap_inst = 0;
+static bool replaying = false;
+static uint64_t replay_end = 0;
+
+extern uint64_t g_nr_guest_inst;
+
+static void batch_check();
+#endif
+
+#ifdef CONFIG_DIFFTEST_PIPE
+// NEMU pushes the state after each instruction into a ring, and a worker
+// thread steps the reference and compares with it. NEMU only waits for the
+// worker when the ring is full, or when the reference should be touched by
+// NEMU itself, e.g. to skip an instruction.
+typedef struct {
+  vaddr_t pc;
+  uint64_t nr_inst;
+  CPU_state dut;
+} DiffRecord;
+
+#define PIPE_SIZE CONFIG_DIFFTEST_PIPE_SIZE
+// spin for a while before sleeping, when the ring is empty or full
+#define PIPE_SPIN (16 * 1024)
+
+static DiffRecord pipe_ring[PIPE_SIZE];
+// written by NEMU and the worker respectively, on cache lines of their own
+static uint64_t pipe_head __attribute__((aligned(64))) = 0;
+static uint64_t pipe_tail __attribute__((aligned(64))) = 0;
+static bool worker_sleeping = false, dut_waiting = false;
+static int pipe_spin = PIPE_SPIN;
+// set by the worker when the reference differs from a record, which is not
+// consumed until NEMU checks it with isa_difftest_checkregs()
+static bool pipe_failed = false;
+static CPU_state pipe_fail_ref;
+static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipe_cond = PTHREAD_COND_INITIALIZER;
+
+extern uint64_t g_nr_guest_inst;
+
+static void pipe_drain();
+static void init_pipe();
+#endif
+
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 void difftest_skip_ref() {
+  // the instructions before this one are checked first
+  IFDEF(CONFIG_DIFFTEST_BATCH, batch_check());
+  IFDEF(CONFIG_DIFFTEST_PIPE, pipe_drain());
   is_skip_ref = true;
   // If such an instruction is one of the instruction packing in QEMU
   // (see below), we end the process of catching up with QEMU's pc to
@@ -52,6 +128,8 @@ void difftest_skip_ref() {
 //   Let REF run `nr_ref` instructions first.
 //   We expect that DUT will catch up with REF within `nr_dut` instructions.
 void difftest_skip_dut(int nr_ref, int nr_dut) {
+  IFDEF(CONFIG_DIFFTEST_BATCH, batch_check());
+  IFDEF(CONFIG_DIFFTEST_PIPE, pipe_drain());
   skip_dut_nr_inst += nr_dut;
 
   while (nr_ref -- > 0) {
@@ -89,6 +167,7 @@ void init_difftest(char *ref_so_file, long img_size, int port) {
   ref_difftest_init(port);
   ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF);
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+  IFDEF(CONFIG_DIFFTEST_PIPE, init_pipe());
 }
 
 static void checkregs(CPU_state *ref, vaddr_t pc) {
@@ -99,7 +178,7 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
   }
 }
 
-void difftest_step(vaddr_t pc, vaddr_t npc) {
+static void lockstep(vaddr_t pc, vaddr_t npc) {
   CPU_state ref_r;
 
   if (skip_dut_nr_inst > 0) {
@@ -127,6 +206,292 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
 
   checkregs(&ref_r, pc);
 }
+
+#ifdef CONFIG_DIFFTEST_BATCH
+static void snap_drop() {
+  if (snap_pid == 0) return;
+  if (snap_owner == getpid()) {
+    kill(snap_pid, SIGKILL);
+    waitpid(snap_pid, NULL, 0);
+    close(snap_cmd_fd);
+    close(snap_result_fd);
+  }
+  snap_pid = 0;
+}
+
+// in the copy, run again to `replay_end` in lockstep
+static void replay_start(uint64_t end) {
+  replaying = true;
+  replay_end = end;
+  // the checkpoints, the intervals, the trace file and the log belong to the parent
+  IFDEF(CONFIG_CHECKPOINT, ckpt_next = UINT64_MAX);
+  IFDEF(CONFIG_SAMPLE, sample_next = UINT64_MAX);
+  IFDEF(CONFIG_REVERSE, rev_next = UINT64_MAX);
+  IFDEF(CONFIG_BTRACE, btrace_fork());
+  log_fork(NULL);
+}
+
+// in the copy, called after each instruction, it never returns at the end
+static void replay_check(bool stop) {
+  ReplayResult r = { .found = (nemu_state.state == NEMU_ABORT),
+    .nr_inst = g_nr_guest_inst, .pc = nemu_state.halt_pc };
+  if (!r.found && !stop && g_nr_guest_inst < replay_end) return;
+  log_flush();
+  fflush(NULL);
+  bool ok = write(snap_result_fd, &r, sizeof(r)) == sizeof(r);
+  _exit(ok ? 0 : 1);
+}
+
+static void snap_take() {
+  snap_drop();
+  int cmd[2], result[2];
+  bool ok = pipe(cmd) == 0 && pipe(result) == 0;
+  Assert(ok, "fail to create the pipes of the difftest snapshot");
+  log_flush();
+  fflush(NULL);
+  pid_t pid = fork();
+  Assert(pid >= 0, "fail to fork the difftest snapshot");
+  if (pid > 0) {
+    close(cmd[0]);
+    close(result[1]);
+    snap_pid = pid;
+    snap_owner = getpid();
+    snap_cmd_fd = cmd[1];
+    snap_result_fd = result[0];
+    snap_inst = g_nr_guest_inst - 1;
+    return;
+  }
+
+  close(cmd[1]);
+  close(result[0]);
+  uint64_t end;
+  if (read(cmd[0], &end, sizeof(end)) != sizeof(end)) _exit(0);
+  close(cmd[0]);
+  snap_pid = 0;
+  snap_result_fd = result[1];
+  replay_start(end);
+}
+
+static void batch_mismatch(uint64_t nr_inst) {
+  nemu_state.state = NEMU_ABORT;
+  nemu_state.halt_pc = batch_prev_pc;
+  if (snap_pid == 0 || snap_owner != getpid()) {
+    Log("Difftest: different after instruction %" PRIu64 ", no snapshot to find the first difference", nr_inst);
+    return;
+  }
+  Log("Difftest: different after instruction %" PRIu64 ", running again in lockstep after instruction %"
+      PRIu64 " to find the first difference", nr_inst, snap_inst);
+  log_flush();
+  fflush(NULL);
+  ReplayResult r = { .found = false };
+  bool ok = write(snap_cmd_fd, &nr_inst, sizeof(nr_inst)) == sizeof(nr_inst) &&
+    read(snap_result_fd, &r, sizeof(r)) == sizeof(r);
+  waitpid(snap_pid, NULL, 0);
+  close(snap_cmd_fd);
+  close(snap_result_fd);
+  snap_pid = 0;
+  if (!ok) {
+    Log("Difftest: the snapshot fails to run again");
+  } else if (!r.found) {
+    Log("Difftest: no difference is found in lockstep, is the reference deterministic?");
+  } else {
+    Log("Difftest: the first difference is after instruction %" PRIu64 " at pc = " FMT_WORD, r.nr_inst, r.pc);
+    nemu_state.halt_pc = r.pc;
+  }
+}
+
+// let the reference run the pending instructions, and compare it with the
+// state of the DUT after the last one
+static void batch_check() {
+  if (replaying || batch_pending == 0) return;
+  ref_difftest_exec(batch_pending);
+  batch_pending = 0;
+  CPU_state ref_r;
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+  // isa_difftest_checkregs() compares with `cpu`
+  CPU_state now = cpu;
+  cpu = batch_prev;
+  bool ok = isa_difftest_checkregs(&ref_r, batch_prev_pc);
+  cpu = now;
+  if (!ok) batch_mismatch(g_nr_guest_inst);
+  else if (batch_size < CONFIG_DIFFTEST_BATCH_MAX) batch_size *= 2;
+}
+
+void difftest_sync() {
+  if (replaying) replay_check(true);
+  if (nemu_state.state != NEMU_ABORT) batch_check();
+  // the snapshot is not taken in this cpu_exec(), and can not run again to the end
+  snap_drop();
+}
+
+void difftest_step(vaddr_t pc, vaddr_t npc) {
+  if (!replaying && batch_pending == 0 && skip_dut_nr_inst == 0 &&
+      (snap_pid == 0 || snap_owner != getpid() || g_nr_guest_inst - snap_inst > CONFIG_DIFFTEST_BATCH_MAX)) {
+    // the reference is at the state before this instruction
+    snap_take();
+  }
+  if (replaying || skip_dut_nr_inst > 0 || is_skip_ref) {
+    lockstep(pc, npc);
+    if (replaying) replay_check(false);
+    return;
+  }
+  batch_prev = cpu;
+  batch_prev_pc = pc;
+  if (++ batch_pending >= batch_size) batch_check();
+}
+#elif defined(CONFIG_DIFFTEST_PIPE)
+// wait until `cond` holds, spinning for a while first when there is another
+// host core to run the other side
+#define pipe_wait(cond, flag) do { \
+  for (int i = 0; i < pipe_spin && !(cond); i ++) ; \
+  if (cond) break; \
+  pthread_mutex_lock(&pipe_lock); \
+  while (true) { \
+    __atomic_store_n(&flag, true, __ATOMIC_SEQ_CST); \
+    if (cond) break; \
+    pthread_cond_wait(&pipe_cond, &pipe_lock); \
+  } \
+  flag = false; \
+  pthread_mutex_unlock(&pipe_lock); \
+} while (0)
+
+// the flag is cleared, so that the waiter is only woken once
+static void pipe_wake(bool *flag) {
+  if (!__atomic_load_n(flag, __ATOMIC_SEQ_CST)) return;
+  pthread_mutex_lock(&pipe_lock);
+  *flag = false;
+  pthread_cond_broadcast(&pipe_cond);
+  pthread_mutex_unlock(&pipe_lock);
+}
+
+#define ring_head() __atomic_load_n(&pipe_head, __ATOMIC_SEQ_CST)
+#define ring_tail() __atomic_load_n(&pipe_tail, __ATOMIC_SEQ_CST)
+#define failed()    __atomic_load_n(&pipe_failed, __ATOMIC_SEQ_CST)
+
+static void *pipe_worker(void *arg) {
+  while (true) {
+    uint64_t tail = pipe_tail;
+    pipe_wait(ring_head() != tail && !failed(), worker_sleeping);
+    DiffRecord *r = &pipe_ring[tail % PIPE_SIZE];
+    ref_difftest_exec(1);
+    // the fields not provided by the reference are left equal
+    CPU_state ref_r = r->dut;
+    ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+    if (memcmp(&ref_r, &r->dut, sizeof(ref_r)) != 0) {
+      pipe_fail_ref = ref_r;
+      __atomic_store_n(&pipe_failed, true, __ATOMIC_SEQ_CST);
+      pipe_wake(&dut_waiting);
+      pipe_wait(!failed(), worker_sleeping);
+    }
+    __atomic_store_n(&pipe_tail, tail + 1, __ATOMIC_SEQ_CST);
+    // NEMU waits for the ring to be half empty, not to ping-pong on a single core
+    if (ring_head() - (tail + 1) <= PIPE_SIZE / 2) pipe_wake(&dut_waiting);
+  }
+  return NULL;
+}
+
+// check the record the worker stops at, NEMU is ahead of it
+static void pipe_report() {
+  static bool reported = false;
+  if (reported) return;
+  DiffRecord *r = &pipe_ring[pipe_tail % PIPE_SIZE];
+  CPU_state now = cpu;
+  cpu = r->dut;
+  bool ok = isa_difftest_checkregs(&pipe_fail_ref, r->pc);
+  if (!ok) {
+    nemu_state.state = NEMU_ABORT;
+    nemu_state.halt_pc = r->pc;
+    isa_reg_display();
+  }
+  cpu = now;
+  if (!ok) {
+    reported = true;
+    Log("Difftest: the first difference is after instruction %" PRIu64 ", NEMU is %" PRIu64
+        " instructions ahead", r->nr_inst, g_nr_guest_inst - r->nr_inst);
+    return;
+  }
+  // only the fields not checked by the ISA differ, let the worker go on
+  pthread_mutex_lock(&pipe_lock);
+  pipe_failed = false;
+  pthread_cond_broadcast(&pipe_cond);
+  pthread_mutex_unlock(&pipe_lock);
+}
+
+// wait for the worker to check all the records, or to stop at a difference
+static void pipe_drain() {
+  do {
+    pipe_wake(&worker_sleeping);
+    pipe_wait(ring_tail() == pipe_head || failed(), dut_waiting);
+    if (!failed()) return;
+    pipe_report();
+  } while (!failed());
+}
+
+void difftest_sync() {
+  pipe_drain();
+}
+
+void difftest_step(vaddr_t pc, vaddr_t npc) {
+  if (failed()) {
+    pipe_report();
+    if (failed()) return;
+  }
+  if (skip_dut_nr_inst > 0 || is_skip_ref) {
+    // the ring is drained by difftest_skip_ref() and difftest_skip_dut()
+    lockstep(pc, npc);
+    return;
+  }
+  uint64_t head = pipe_head;
+  if (head - ring_tail() == PIPE_SIZE) {
+    pipe_wake(&worker_sleeping);
+    pipe_wait(head - ring_tail() < PIPE_SIZE || failed(), dut_waiting);
+    if (failed()) {
+      pipe_report();
+      if (failed()) return;
+    }
+  }
+  DiffRecord *r = &pipe_ring[head % PIPE_SIZE];
+  r->pc = pc;
+  r->nr_inst = g_nr_guest_inst;
+  r->dut = cpu;
+  __atomic_store_n(&pipe_head, head + 1, __ATOMIC_SEQ_CST);
+  // the worker is woken when the ring is half full, or when NEMU waits for it
+  if (head + 1 - ring_tail() >= PIPE_SIZE / 2) pipe_wake(&worker_sleeping);
+}
+
+static void pipe_start() {
+  pthread_t worker;
+  int ret = pthread_create(&worker, NULL, pipe_worker, NULL);
+  assert(ret == 0);
+  pthread_detach(worker);
+}
+
+// a forked child, such as a snapshot of reverse execution, gets a worker of its own
+static void pipe_fork_prepare() {
+  // the child should not inherit the worker in the middle of a record
+  pipe_drain();
+}
+
+static void pipe_fork_child() {
+  pthread_mutex_init(&pipe_lock, NULL);
+  pthread_cond_init(&pipe_cond, NULL);
+  worker_sleeping = dut_waiting = false;
+  pipe_start();
+}
+
+static void init_pipe() {
+  if (sysconf(_SC_NPROCESSORS_ONLN) <= 1) pipe_spin = 0;
+  pthread_atfork(pipe_fork_prepare, NULL, pipe_fork_child);
+  pipe_start();
+  Log("Difftest: the reference runs on a thread of its own, at most %d instructions behind", PIPE_SIZE);
+}
+#else
+void difftest_sync() { }
+
+void difftest_step(vaddr_t pc, vaddr_t npc) {
+  lockstep(pc, npc);
+}
+#endif
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
 #endif
@@ -0,0 +1,53 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#include <cpu/icache.h>
+
+#ifdef CONFIG_ICACHE
+
+ICacheEntry icache[ICACHE_SIZE] = {};
+// whether a page of pmem may hold instructions in the cache
+uint8_t icache_page[CONFIG_MSIZE / PAGE_SIZE] = {};
+
+static void invalidate_entry(paddr_t addr)
+{
+  ICacheEntry *e = icache_entry(addr);
+  if (e->pc == (addr & ~(paddr_t)3))
+  {
+    e->handler = NULL;
+  }
+}
+
+// the written bytes may be covered by at most two instructions
+void icache_invalidate(paddr_t addr, int len)
+{
+  invalidate_entry(addr);
+  invalidate_entry(addr + len - 1);
+}
+
+void icache_flush()
+{
+  for (int i = 0; i < CONFIG_MSIZE / PAGE_SIZE; i++)
+  {
+    if (icache_page[i])
+    {
+      paddr_protect_page(CONFIG_MBASE + i * PAGE_SIZE, false);
+    }
+  }
+  memset(icache, 0, sizeof(icache));
+  memset(icache_page, 0, sizeof(icache_page));
+}
+
+#endif
@@ -21,6 +21,7 @@
 #endif
 
 void init_map();
+void map_register_space();
 void init_serial();
 void init_timer();
 void init_vga();
@@ -84,6 +85,7 @@ void init_device() {
   IFDEF(CONFIG_HAS_AUDIO, init_audio());
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
+  IFDEF(CONFIG_CHECKPOINT, map_register_space());
 
   IFNDEF(CONFIG_TARGET_AM, init_alarm());
 }
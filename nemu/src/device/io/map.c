@@ -17,6 +17,7 @@
 #include <memory/host.h>
 #include <memory/vaddr.h>
 #include <device/map.h>
+#include <monitor/checkpoint.h>
 
 #define IO_SPACE_MAX (2 * 1024 * 1024)
 
@@ -32,6 +33,49 @@ uint8_t* new_space(int size) {
   return p;
 }
 
+static IOPage* get_page(IOMapIndex *idx, uint64_t addr) {
+  IOPage **dir = &idx->dir[addr >> IO_DIR_SHIFT];
+  if (*dir == NULL) {
+    *dir = calloc(1 << (IO_DIR_SHIFT - IO_PAGE_SHIFT), sizeof(IOPage));
+    assert(*dir);
+  }
+  return &(*dir)[(addr >> IO_PAGE_SHIFT) & ((1 << (IO_DIR_SHIFT - IO_PAGE_SHIFT)) - 1)];
+}
+
+// add a map to the index, where the maps added earlier win on overlapped bytes
+IOMap* add_map(IOMapIndex *idx, IOMap map) {
+  Assert((uint64_t)map.high >> 32 == 0, "map '%s' is out of the 32-bit address space", map.name);
+  IOMap *m = malloc(sizeof(*m));
+  assert(m);
+  *m = map;
+  idx->maps = realloc(idx->maps, sizeof(idx->maps[0]) * (idx->nr_map + 1));
+  assert(idx->maps);
+  idx->maps[idx->nr_map ++] = m;
+
+  const uint64_t page_size = 1 << IO_PAGE_SHIFT;
+  uint64_t addr = m->low;
+  while (addr <= m->high) {
+    IOPage *page = get_page(idx, addr);
+    uint64_t page_low = addr & ~(page_size - 1);
+    uint64_t end = (m->high < page_low + page_size - 1 ? m->high : page_low + page_size - 1);
+    if (addr == page_low && end == page_low + page_size - 1 && page->map == NULL && page->byte == NULL) {
+      page->map = m;
+    } else {
+      if (page->byte == NULL) {
+        page->byte = malloc(sizeof(page->byte[0]) * page_size);
+        assert(page->byte);
+        for (int i = 0; i < page_size; i ++) { page->byte[i] = page->map; }
+        page->map = NULL;
+      }
+      for (uint64_t a = addr; a <= end; a ++) {
+        if (page->byte[a - page_low] == NULL) { page->byte[a - page_low] = m; }
+      }
+    }
+    addr = end + 1;
+  }
+  return m;
+}
+
 static void check_bound(IOMap *map, paddr_t addr) {
   if (map == NULL) {
     Assert(map != NULL, "address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
@@ -42,6 +86,13 @@ static void check_bound(IOMap *map, paddr_t addr) {
   }
 }
 
+#ifdef CONFIG_CHECKPOINT
+// called after the devices are initialized, their spaces are saved as a whole
+void map_register_space() {
+  ckpt_register("io_space", io_space, p_space - io_space, NULL);
+}
+#endif
+
 static void invoke_callback(io_callback_t c, paddr_t offset, int len, bool is_write) {
   if (c != NULL) { c(offset, len, is_write); }
 }
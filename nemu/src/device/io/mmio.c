@@ -16,14 +16,10 @@
 #include <device/map.h>
 #include <memory/paddr.h>
 
-#define NR_MAP 16
-
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+static IOMapIndex maps = {};
 
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  return find_map_by_addr(&maps, addr);
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -34,23 +30,25 @@ static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
 
 /* device interface */
 void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
   paddr_t left = addr, right = addr + len - 1;
   if (in_pmem(left) || in_pmem(right)) {
     report_mmio_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
   }
-  for (int i = 0; i < nr_map; i++) {
-    if (left <= maps[i].high && right >= maps[i].low) {
-      report_mmio_overlap(name, left, right, maps[i].name, maps[i].low, maps[i].high);
+  for (int i = 0; i < maps.nr_map; i++) {
+    IOMap *m = maps.maps[i];
+    if (left <= m->high && right >= m->low) {
+      report_mmio_overlap(name, left, right, m->name, m->low, m->high);
     }
   }
 
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
-    .space = space, .callback = callback };
+  IOMap *map = add_map(&maps, (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+    .space = space, .callback = callback });
   Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
+      map->name, map->low, map->high);
 
-  nr_map ++;
+  // device memory without side effect is accessed directly, except that
+  // DiffTest should see every device access to skip checking the reference
+  if (callback == NULL && ISNDEF(CONFIG_DIFFTEST)) { paddr_map_host(addr, len, space); }
 }
 
 /* bus interface */
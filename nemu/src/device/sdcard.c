@@ -14,6 +14,8 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <utils.h>
+#include <monitor/checkpoint.h>
 #include "mmc.h"
 
 // http://www.files.e-shop.co.il/pdastore/Tech-mmc-samsung/SEC%20MMC%20SPEC%20ver09.pdf
@@ -122,6 +124,13 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
   }
 }
 
+#ifdef CONFIG_CHECKPOINT
+// the image is at the block of the last command, after the words transferred
+static void sdcard_restore() {
+  if (fp) fseek(fp, (blk_addr << 9) + addr, SEEK_SET);
+}
+#endif
+
 void init_sdcard() {
   base = (uint32_t *)new_space(0x80);
   add_mmio_map("sdhci", CONFIG_SDCARD_CTL_MMIO, base, 0x80, sdcard_io_handler);
@@ -131,4 +140,12 @@ void init_sdcard() {
   const char *img = CONFIG_SDCARD_IMG_PATH;
   fp = fopen(img, "r+");
   if (fp == NULL) Log("Can not find sdcard image: %s", img);
+
+#ifdef CONFIG_CHECKPOINT
+  ckpt_register("sdcard.blkcnt", &blkcnt, sizeof(blkcnt), NULL);
+  ckpt_register("sdcard.blk_addr", &blk_addr, sizeof(blk_addr), NULL);
+  ckpt_register("sdcard.addr", &addr, sizeof(addr), NULL);
+  ckpt_register("sdcard.write_cmd", &write_cmd, sizeof(write_cmd), NULL);
+  ckpt_register("sdcard.read_ext_csd", &read_ext_csd, sizeof(read_ext_csd), sdcard_restore);
+#endif
 }
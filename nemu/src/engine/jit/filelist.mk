@@ -0,0 +1,21 @@
+#***************************************************************************************
+# Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+#
+# NEMU is licensed under Mulan PSL v2.
+# You can use this software according to the terms and conditions of the Mulan PSL v2.
+# You may obtain a copy of Mulan PSL v2 at:
+#          http://license.coscl.org.cn/MulanPSL2
+#
+# THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+# EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+# MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+#
+# See the Mulan PSL v2 for more details.
+#**************************************************************************************/
+
+# the JIT engine runs on top of the basic blocks of the threaded engine
+ifdef CONFIG_ENGINE_JIT
+INC_PATH += $(NEMU_HOME)/src/engine/threaded
+SRCS-y += src/engine/interpreter/hostcall.c src/engine/interpreter/init.c
+SRCS-y += src/engine/threaded/tb.c
+endif
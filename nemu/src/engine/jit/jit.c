@@ -0,0 +1,244 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/icache.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "tb.h"
+
+// Hot blocks of the threaded engine are translated into x86-64 code.
+// addi, auipc, lbu, sb, sw, jal and jalr are emitted inline, with the guest
+// registers kept in `cpu` and loads/stores going straight to the host
+// memory of the pages in ppage_r/ppage_w. Any other instruction calls
+// back into the pre-decoded interpreter. The generated function writes
+// `cpu.pc` itself and returns the number of instructions executed.
+//
+// Register usage: rbx = &cpu, r12 = ppage_r, r13 = ppage_w,
+// eax/ecx/edx/r8 are scratch. With CONFIG_PMEM_GUARD, r12 = guard_base
+// instead and loads go to it without any check.
+
+#if !defined(__x86_64__)
+#error The JIT engine only supports x86-64 hosts
+#endif
+#ifdef PMEM64
+#error The JIT engine requires the physical memory below 4 GiB
+#endif
+
+enum { EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESI = 6, EDI = 7 };
+
+static uint8_t *code_cache = NULL;
+static uint8_t *code_ptr = NULL;
+static uint8_t *code_end = NULL;
+
+#define GPR_OFF(i) ((uint32_t)(offsetof(CPU_state, gpr) + (i) * sizeof(word_t)))
+#define PC_OFF     ((uint32_t)offsetof(CPU_state, pc))
+
+// the longest sequence of a single guest instruction,
+// leave enough room before emitting each of them
+#define MAX_OP_CODE 128
+
+static inline void emit8(uint8_t x) { *code_ptr ++ = x; }
+static inline void emit32(uint32_t x) { memcpy(code_ptr, &x, 4); code_ptr += 4; }
+static inline void emit64(uint64_t x) { memcpy(code_ptr, &x, 8); code_ptr += 8; }
+
+// mov r32, [rbx + disp32]
+static void emit_load_cpu(int r, uint32_t off) { emit8(0x8b); emit8(0x83 | (r << 3)); emit32(off); }
+// mov [rbx + disp32], r32
+static void emit_store_cpu(int r, uint32_t off) { emit8(0x89); emit8(0x83 | (r << 3)); emit32(off); }
+// mov dword [rbx + disp32], imm32
+static void emit_store_cpu_imm(uint32_t off, uint32_t imm) { emit8(0xc7); emit8(0x83); emit32(off); emit32(imm); }
+// mov r32, imm32
+static void emit_mov_imm(int r, uint32_t imm) { emit8(0xb8 | r); emit32(imm); }
+// mov rax, imm64; call rax
+static void emit_call(const void *fn) { emit8(0x48); emit8(0xb8); emit64((uintptr_t)fn); emit8(0xff); emit8(0xd0); }
+
+// jcc/jmp rel32 with the target unknown yet, return the place to patch
+static uint8_t* emit_jcc(uint8_t cc) { emit8(0x0f); emit8(cc); emit32(0); return code_ptr - 4; }
+static uint8_t* emit_jmp() { emit8(0xe9); emit32(0); return code_ptr - 4; }
+static void patch(uint8_t *rel) { int32_t d = code_ptr - (rel + 4); memcpy(rel, &d, 4); }
+
+#define JE 0x84
+#define JA 0x87
+
+static void emit_exit(int nr_exec) {
+  emit_mov_imm(EAX, nr_exec);
+  emit8(0x41); emit8(0x5d);  // pop r13
+  emit8(0x41); emit8(0x5c);  // pop r12
+  emit8(0x5b);               // pop rbx
+  emit8(0xc3);               // ret
+}
+
+// eax = R(rs1) + imm
+static void emit_addr(ICacheEntry *op) {
+  emit_load_cpu(EAX, GPR_OFF(op->rs1));
+  emit8(0x05); emit32(op->imm);  // add eax, imm32
+}
+
+// r8 + rcx = host address of the guest address in eax, looked up in the
+// same page table as vaddr_read()/vaddr_write(), the returned places
+// jump to the slow path if the page is not mapped or the access crosses it
+static void emit_host_addr(bool is_write, int len, uint8_t *slow[2]) {
+  emit8(0x89); emit8(0xc1);                     // mov ecx, eax
+  emit8(0xc1); emit8(0xe9); emit8(PAGE_SHIFT);  // shr ecx, PAGE_SHIFT
+  if (is_write) { emit8(0x4d); emit8(0x8b); emit8(0x44); emit8(0xcd); emit8(0x00); }  // mov r8, [r13 + rcx * 8 + 0]
+  else { emit8(0x4d); emit8(0x8b); emit8(0x04); emit8(0xcc); }                     // mov r8, [r12 + rcx * 8]
+  emit8(0x4d); emit8(0x85); emit8(0xc0);               // test r8, r8
+  slow[0] = emit_jcc(JE);
+  emit8(0x89); emit8(0xc1);                     // mov ecx, eax
+  emit8(0x81); emit8(0xe1); emit32(PAGE_MASK);  // and ecx, PAGE_MASK
+  slow[1] = NULL;
+  if (len > 1) {
+    emit8(0x81); emit8(0xf9); emit32(PAGE_SIZE - len);  // cmp ecx, imm32
+    slow[1] = emit_jcc(JA);
+  }
+}
+
+static void patch_slow(uint8_t *slow[2]) {
+  patch(slow[0]);
+  if (slow[1] != NULL) { patch(slow[1]); }
+}
+
+static void emit_lbu(ICacheEntry *op) {
+  emit_addr(op);
+#ifdef CONFIG_PMEM_GUARD
+  // the SIGSEGV handler emulates the load if it faults
+  emit8(0x41); emit8(0x0f); emit8(0xb6); emit8(0x04); emit8(0x04);  // movzx eax, byte [r12 + rax]
+#else
+  uint8_t *slow[2];
+  emit_host_addr(false, 1, slow);
+  emit8(0x41); emit8(0x0f); emit8(0xb6); emit8(0x04); emit8(0x08);  // movzx eax, byte [r8 + rcx]
+  uint8_t *done = emit_jmp();
+
+  patch_slow(slow);
+  emit_store_cpu_imm(PC_OFF, op->pc);  // for the error message of out_of_bound()
+  emit8(0x89); emit8(0xc7);            // mov edi, eax
+  emit_mov_imm(ESI, 1);
+  emit_call(vaddr_read);
+
+  patch(done);
+#endif
+  if (op->rd != 0) { emit_store_cpu(EAX, GPR_OFF(op->rd)); }
+}
+
+// pages holding translated code are not mapped in ppage_w,
+// so the stores to them take the slow path to invalidate the blocks
+static void emit_store(ICacheEntry *op, int len) {
+  uint8_t *slow[2];
+  emit_addr(op);
+  emit_load_cpu(EDX, GPR_OFF(op->rs2));
+  emit_host_addr(true, len, slow);
+  if (len == 4) { emit8(0x41); emit8(0x89); emit8(0x14); emit8(0x08); }  // mov [r8 + rcx], edx
+  else { emit8(0x41); emit8(0x88); emit8(0x14); emit8(0x08); }           // mov [r8 + rcx], dl
+  uint8_t *done = emit_jmp();
+
+  patch_slow(slow);
+  emit_store_cpu_imm(PC_OFF, op->pc);
+  emit8(0x89); emit8(0xc7);  // mov edi, eax
+  emit_mov_imm(ESI, len);
+  emit_call(vaddr_write);
+
+  patch(done);
+}
+
+// run a single instruction with the interpreter, which sets cpu.pc to
+// op->pc first for its error messages,
+// return whether the block should be left after it
+static bool jit_exec_op(ICacheEntry *op) {
+  Decode s;
+  isa_exec_ops(&s, op, 1);
+  cpu.pc = s.dnpc;
+  return s.dnpc != s.snpc || nemu_state.state != NEMU_RUNNING;
+}
+
+static void emit_helper(ICacheEntry *op, int nr_exec, bool last) {
+  emit8(0x48); emit8(0xbf); emit64((uintptr_t)op);  // mov rdi, op
+  emit_call(jit_exec_op);
+  if (last) { emit_exit(nr_exec); return; }
+  emit8(0x84); emit8(0xc0);  // test al, al
+  uint8_t *next = emit_jcc(0x84);  // je
+  emit_exit(nr_exec);
+  patch(next);
+}
+
+TBCode jit_compile(TBlock *b) {
+  if (code_cache == NULL) {
+    code_cache = mmap(NULL, CONFIG_JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    Assert(code_cache != MAP_FAILED, "fail to allocate the code cache");
+    code_ptr = code_cache;
+    code_end = code_cache + CONFIG_JIT_CACHE_SIZE;
+  }
+  if (code_end - code_ptr < (b->nr_op + 1) * MAX_OP_CODE) { return NULL; }
+
+  uint8_t *entry = code_ptr;
+  emit8(0x53);               // push rbx
+  emit8(0x41); emit8(0x54);  // push r12
+  emit8(0x41); emit8(0x55);  // push r13, the stack is now aligned to 16 bytes for calls
+  emit8(0x48); emit8(0xbb); emit64((uintptr_t)&cpu);     // mov rbx, &cpu
+#ifdef CONFIG_PMEM_GUARD
+  emit8(0x49); emit8(0xbc); emit64((uintptr_t)guard_base);  // mov r12, guard_base
+#else
+  emit8(0x49); emit8(0xbc); emit64((uintptr_t)ppage_r);  // mov r12, ppage_r
+#endif
+  emit8(0x49); emit8(0xbd); emit64((uintptr_t)ppage_w);  // mov r13, ppage_w
+
+  for (int i = 0; i < b->nr_op; i ++) {
+    ICacheEntry *op = &b->ops[i];
+    uint32_t opcode = BITS(op->inst, 6, 0);
+    uint32_t funct3 = BITS(op->inst, 14, 12);
+    bool last = (i == b->nr_op - 1);
+
+    if (opcode == 0x13 && funct3 == 0) {  // addi
+      if (op->rd != 0) {
+        emit_addr(op);
+        emit_store_cpu(EAX, GPR_OFF(op->rd));
+      }
+    } else if (opcode == 0x17) {  // auipc
+      if (op->rd != 0) { emit_store_cpu_imm(GPR_OFF(op->rd), op->pc + op->imm); }
+    } else if (opcode == 0x03 && funct3 == 4) {  // lbu
+      emit_lbu(op);
+    } else if (opcode == 0x23 && (funct3 == 0 || funct3 == 2)) {  // sb, sw
+      emit_store(op, funct3 == 0 ? 1 : 4);
+    } else if (opcode == 0x6f) {  // jal, the offset is decoded without its bit 0
+      if (op->rd != 0) { emit_store_cpu_imm(GPR_OFF(op->rd), op->pc + 4); }
+      emit_store_cpu_imm(PC_OFF, op->pc + (op->imm << 1));
+      emit_exit(i + 1);
+      break;
+    } else if (opcode == 0x67 && funct3 == 0) {  // jalr
+      emit_addr(op);
+      if (op->rd != 0) { emit_store_cpu_imm(GPR_OFF(op->rd), op->pc + 4); }
+      emit_store_cpu(EAX, PC_OFF);
+      emit_exit(i + 1);
+      break;
+    } else {
+      emit_helper(op, i + 1, last);
+      continue;
+    }
+
+    if (last) {
+      emit_store_cpu_imm(PC_OFF, b->end);
+      emit_exit(i + 1);
+    }
+  }
+
+  return (TBCode)entry;
+}
+
+void jit_reset() {
+  code_ptr = code_cache;
+}
@@ -0,0 +1,159 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/icache.h>
+#include "tb.h"
+
+// A basic block is translated once into an array of pre-decoded
+// instructions (the same entries as the decode cache), which are then
+// executed back to back by isa_exec_ops() with computed goto.
+// A block ends at a control flow instruction, a page boundary, or after
+// TB_MAX_INST instructions. Blocks ending with a direct jump or branch
+// remember their successors, so that they are reached without a lookup.
+
+#define NR_TB (1 << 14)
+#define NR_TB_OP (1 << 20)
+#define TB_HASH_SIZE (1 << 14)
+
+static TBlock tb_pool[NR_TB] = {};
+static ICacheEntry tb_op_pool[NR_TB_OP] = {};
+static int nr_tb = 0, nr_tb_op = 0;
+static uint64_t tb_generation = 0;  // increased by each flush
+static TBlock *tb_hash[TB_HASH_SIZE] = {};
+TBlock *tb_page[CONFIG_MSIZE / PAGE_SIZE] = {};
+
+extern uint64_t g_nr_guest_inst;
+void device_update();
+
+void tb_flush() {
+  IFDEF(CONFIG_ENGINE_JIT, jit_reset());
+  for (int i = 0; i < CONFIG_MSIZE / PAGE_SIZE; i ++) {
+    if (tb_page[i] != NULL) { paddr_protect_page(CONFIG_MBASE + i * PAGE_SIZE, false); }
+  }
+  nr_tb = 0;
+  nr_tb_op = 0;
+  tb_generation ++;
+  memset(tb_hash, 0, sizeof(tb_hash));
+  memset(tb_page, 0, sizeof(tb_page));
+}
+
+static TBlock* tb_translate(vaddr_t pc) {
+  if (nr_tb == NR_TB || nr_tb_op + TB_MAX_INST > NR_TB_OP) { tb_flush(); }
+
+  TBlock *b = &tb_pool[nr_tb ++];
+  *b = (TBlock){ .pc = pc, .valid = true, .direct = true, .ops = &tb_op_pool[nr_tb_op] };
+
+  Decode s = { .pc = pc, .snpc = pc };
+  while (b->nr_op < TB_MAX_INST) {
+    bool end = isa_decode_once(&s, &b->ops[b->nr_op], &b->direct);
+    b->nr_op ++;
+    // a block never crosses a page, so it can be found from the page it lives in
+    if (end || (s.snpc & ~PAGE_MASK) != (pc & ~PAGE_MASK)) { break; }
+    s.pc = s.snpc;
+  }
+  b->end = s.snpc;
+  nr_tb_op += b->nr_op;
+
+  tb_hash[(pc >> 2) & (TB_HASH_SIZE - 1)] = b;
+  if (in_pmem(pc)) {
+    TBlock **head = &tb_page[(pc - CONFIG_MBASE) >> PAGE_SHIFT];
+    // writes to the page should go through paddr_write() to be seen
+    if (*head == NULL) { paddr_protect_page(pc, true); }
+    b->page_next = *head;
+    *head = b;
+  }
+  return b;
+}
+
+static TBlock* tb_lookup(vaddr_t pc) {
+  TBlock *b = tb_hash[(pc >> 2) & (TB_HASH_SIZE - 1)];
+  if (b == NULL || b->pc != pc || !b->valid) { b = tb_translate(pc); }
+  return b;
+}
+
+// find the block to run after `b`, which is left at `pc`
+static TBlock* tb_next(TBlock *b, vaddr_t pc, bool complete) {
+  for (int i = 0; i < 2; i ++) {
+    TBlock *next = b->chain[i];
+    if (next != NULL && next->pc == pc && next->valid) { return next; }
+  }
+
+  uint64_t generation = tb_generation;
+  TBlock *next = tb_lookup(pc);
+  // do not chain if `b` is flushed by the translation above,
+  // or it is left early (e.g. by running out of instructions)
+  if (b->direct && complete && generation == tb_generation) {
+    int i = (b->chain[0] == NULL || !b->chain[0]->valid) ? 0 : 1;
+    b->chain[i] = next;
+  }
+  return next;
+}
+
+// return the number of instructions left when paging is enabled, since
+// blocks are keyed by virtual pc and the JIT accesses pmem directly
+uint64_t tb_execute(uint64_t n) {
+  Decode s;
+  TBlock *b = NULL;
+  int nr_exec = 0;
+  while (n > 0 && isa_mmu_check(cpu.pc, 4, MEM_TYPE_IFETCH) == MMU_DIRECT) {
+    b = (b == NULL ? tb_lookup(cpu.pc) : tb_next(b, cpu.pc, nr_exec == b->nr_op));
+#ifdef CONFIG_ENGINE_JIT
+    if (b->code == NULL && ++ b->nr_run == CONFIG_JIT_HOT_THRESHOLD) {
+      b->code = jit_compile(b);
+      if (b->code == NULL) {
+        // the code cache is full, start over
+        tb_flush();
+        b = tb_lookup(cpu.pc);
+      }
+    }
+    if (b->code != NULL && n >= b->nr_op) {
+      nr_exec = b->code();
+    } else
+#endif
+    {
+      int nr_op = (n < b->nr_op ? n : b->nr_op);
+      nr_exec = isa_exec_ops(&s, b->ops, nr_op);
+      cpu.pc = s.dnpc;
+    }
+    g_nr_guest_inst += nr_exec;
+    n -= nr_exec;
+    if (nemu_state.state != NEMU_RUNNING) { break; }
+    // at the same rate as the interpreter, whatever the length of the blocks
+    if (((g_nr_guest_inst - nr_exec) | DEVICE_UPDATE_MASK) != (g_nr_guest_inst | DEVICE_UPDATE_MASK)) {
+      IFDEF(CONFIG_DEVICE, device_update());
+      if (nemu_state.state != NEMU_RUNNING) { break; }
+    }
+  }
+  return n;
+}
+
+// drop the blocks covering the written bytes, the running block
+// still finishes with its old instructions
+void tb_invalidate(paddr_t addr, int len) {
+  TBlock **p = &tb_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT];
+  while (*p != NULL) {
+    TBlock *b = *p;
+    if (addr < b->end && addr + len > b->pc) {
+      b->valid = false;
+      *p = b->page_next;
+    } else {
+      p = &b->page_next;
+    }
+  }
+  if (tb_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT] == NULL) { paddr_protect_page(addr, false); }
+}
@@ -0,0 +1,63 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#ifndef __TB_H__
+#define __TB_H__
+
+#include <common.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+#define TB_MAX_INST 64
+
+struct ICacheEntry;
+// host code of a block, returns the number of instructions executed
+typedef int (*TBCode)();
+
+typedef struct TBlock {
+  vaddr_t pc;
+  vaddr_t end;  // pc of the instruction following the block
+  int nr_op;
+  bool valid;
+  bool direct;  // the successors are fixed, so they can be chained
+  struct ICacheEntry *ops;
+  struct TBlock *chain[2];
+  struct TBlock *page_next;
+#ifdef CONFIG_ENGINE_JIT
+  uint32_t nr_run;
+  TBCode code;
+#endif
+} TBlock;
+
+// translated blocks living in each page of pmem, linked by TBlock::page_next
+extern TBlock *tb_page[CONFIG_MSIZE / PAGE_SIZE];
+
+uint64_t tb_execute(uint64_t n);
+void tb_invalidate(paddr_t addr, int len);
+void tb_flush();
+
+#ifdef CONFIG_ENGINE_JIT
+TBCode jit_compile(TBlock *b);
+void jit_reset();
+#endif
+
+// called by paddr_write(), only pages holding translated code pay for the invalidation
+static inline void tb_check_write(paddr_t addr, int len) {
+  if (unlikely(tb_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT] != NULL)) {
+    tb_invalidate(addr, len);
+  }
+}
+
+#endif
@@ -47,8 +47,12 @@ static int decode_exec(Decode *s) {
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
+// the leading opcode bits shared by most formats
+#define INSTPAT_DISPATCH_MASK 0xfffc0000u
+#define INSTPAT_DISPATCH(i) BITS(i, 31, 18)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  INSTPAT_COUNT(); \
   __VA_ARGS__ ; \
 }
 
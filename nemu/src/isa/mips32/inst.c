@@ -49,8 +49,12 @@ static int decode_exec(Decode *s) {
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
+// opcode and funct
+#define INSTPAT_DISPATCH_MASK 0xfc00003fu
+#define INSTPAT_DISPATCH(i) (BITS(i, 5, 0) | (BITS(i, 31, 26) << 6))
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  INSTPAT_COUNT(); \
   __VA_ARGS__ ; \
 }
 
@@ -21,6 +21,7 @@
 typedef struct {
   word_t gpr[MUXDEF(CONFIG_RVE, 16, 32)];
   vaddr_t pc;
+  word_t satp;
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
 // decode
@@ -30,6 +31,8 @@ typedef struct {
   } inst;
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
-#define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+// only Sv32 is supported, selected by satp.MODE
+#define isa_mmu_check(vaddr, len, type) \
+  MUXDEF(CONFIG_RV64, MMU_DIRECT, ((cpu.satp >> 31) ? MMU_TRANSLATE : MMU_DIRECT))
 
 #endif
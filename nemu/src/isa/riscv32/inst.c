@@ -17,6 +17,9 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#include <cpu/icache.h>
+#include <utils/ftrace.h>
+#include <utils/bbv.h>
 
 #define R(i) gpr(i)
 #define Mr vaddr_read
@@ -34,15 +37,17 @@ enum
   // ----------
 };
 
-#define src1R()     \
-  do                \
-  {                 \
-    *src1 = R(rs1); \
+#define src1R()       \
+  do                  \
+  {                   \
+    *src1 = R(rs1);   \
+    *src1_idx = rs1;  \
   } while (0)
-#define src2R()     \
-  do                \
-  {                 \
-    *src2 = R(rs2); \
+#define src2R()       \
+  do                  \
+  {                   \
+    *src2 = R(rs2);   \
+    *src2_idx = rs2;  \
   } while (0)
 #define immI()                        \
   do                                  \
@@ -70,7 +75,46 @@ enum
 
 // --------------
 
-static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_t *imm, int type)
+void tlb_flush();
+
+// only satp is implemented among the CSRs for now, NULL for the others
+static word_t *csr(word_t no)
+{
+  switch (no & 0xfff)
+  {
+  case 0x180:
+    return &cpu.satp;
+  }
+  return NULL;
+}
+
+// csrrw and csrrs: rd gets the old value, which is replaced by `val`, or
+// ORed with it if `set`, only if `write`. An unknown CSR is an invalid
+// instruction, like the other encodings not implemented.
+static void csr_access(Decode *s, int rd, word_t no, word_t val, bool set, bool write)
+{
+  word_t *p = csr(no);
+  if (p == NULL)
+  {
+    INV(s->pc);
+    return;
+  }
+  word_t old = *p;
+  if (write)
+  {
+    *p = (set ? old | val : val);
+    if (p == &cpu.satp)
+    {
+      tlb_flush(); // the address space is changed
+    }
+  }
+  R(rd) = old;
+}
+
+// src1_idx/src2_idx record which registers are read, they are left untouched
+// for the unused source operands, so that reading them back gives $zero
+static void decode_operand(Decode *s, int *rd, int *src1_idx, int *src2_idx,
+                           word_t *src1, word_t *src2, word_t *imm, int type)
 {
   uint32_t i = s->isa.inst.val;
   int rs1 = BITS(i, 19, 15);
@@ -79,7 +123,6 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
   switch (type)
   {
   case TYPE_I:
-    printf("rs1=%d\n", rs1);
     src1R();
     immI();
     break;
@@ -100,19 +143,101 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2, word_
   }
 }
 
+#if defined(CONFIG_ICACHE) || defined(CONFIG_ENGINE_TB)
+#define PREDECODE
+#endif
+
+// a basic block of the BBV profile ends at each jump
+#ifdef CONFIG_BBV
+#define BBV_END(s) (bbv_on ? bbv_block((s)->pc, (s)->dnpc) : (void)0)
+#else
+#define BBV_END(s)
+#endif
+
+#ifdef CONFIG_FTRACE
+// ra and t0 are the link registers of the calling convention
+#define IS_LINK(r) ((r) == 1 || (r) == 5)
+
+// jal/jalr with a link register is a call, and `jalr x0, 0(link)' is a
+// return, other jumps may still be tail calls
+static void ftrace_jump_idiom(Decode *s, int rd, bool is_jalr)
+{
+  int rs1 = BITS(s->isa.inst.val, 19, 15);
+  if (IS_LINK(rd))
+  {
+    ftrace_call(s->pc, s->dnpc);
+  }
+  else if (rd == 0 && is_jalr && IS_LINK(rs1) && BITS(s->isa.inst.val, 31, 20) == 0)
+  {
+    ftrace_ret(s->pc, s->dnpc);
+  }
+  else if (rd == 0)
+  {
+    ftrace_jump(s->pc, s->dnpc);
+  }
+}
+#endif
+
 // 译码工作
-static int decode_exec(Decode *s)
+// ops == NULL: decode and execute s->isa.inst
+// ops != NULL, nr_op == 0: only decode s->isa.inst into ops[0]
+// ops != NULL, nr_op > 0: execute the pre-decoded ops[0, nr_op) back to back,
+//   and stop early once the control flow leaves the sequence
+// return the number of instructions executed
+static int decode_exec(Decode *s, ICacheEntry *ops, int nr_op)
 {
   int rd = 0;
   word_t src1 = 0, src2 = 0, imm = 0;
   s->dnpc = s->snpc;
 
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
-#define INSTPAT_MATCH(s, name, type, ... /* execute body */)         \
-  {                                                                  \
-    decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-    __VA_ARGS__;                                                     \
+// opcode, funct3, and the bits of funct7 telling add/sub, srl/sra and RV32M apart
+#define INSTPAT_DISPATCH_MASK 0x4200707cu
+#define INSTPAT_DISPATCH(i) (BITS(i, 6, 2) | (BITS(i, 14, 12) << 5) | (BITS(i, 25, 25) << 8) | (BITS(i, 30, 30) << 9))
+#ifdef PREDECODE
+#define INSTPAT_MATCH(s, name, type, ... /* execute body */)                                          \
+  {                                                                                                   \
+    int rs1 = 0, rs2 = 0;                                                                             \
+    decode_operand(s, &rd, &rs1, &rs2, &src1, &src2, &imm, concat(TYPE_, type));                      \
+    if (ops != NULL)                                                                                  \
+    {                                                                                                 \
+      *ops = (ICacheEntry){.pc = s->pc, .inst = INSTPAT_INST(s), .handler = &&INSTPAT_LABEL,          \
+                           .rd = rd, .rs1 = rs1, .rs2 = rs2, .imm = imm};                             \
+      return 0;                                                                                       \
+    }                                                                                                 \
+  INSTPAT_LABEL:                                                                                      \
+    INSTPAT_COUNT();                                                                                  \
+    __VA_ARGS__;                                                                                      \
   }
+#else
+#define INSTPAT_MATCH(s, name, type, ... /* execute body */)                     \
+  {                                                                              \
+    int rs1 = 0, rs2 = 0;                                                        \
+    decode_operand(s, &rd, &rs1, &rs2, &src1, &src2, &imm, concat(TYPE_, type)); \
+    INSTPAT_COUNT();                                                             \
+    __VA_ARGS__;                                                                 \
+  }
+#endif
+
+#ifdef PREDECODE
+  int nr_exec = 0;
+  if (nr_op > 0)
+  {
+  next_op:
+    // only the source registers need to be read again, and cpu.pc is kept
+    // current for the error messages of the instruction failing in a block
+    s->pc = ops->pc;
+    cpu.pc = s->pc;
+    s->snpc = s->pc + 4;
+    s->dnpc = s->snpc;
+    s->isa.inst.val = ops->inst;
+    rd = ops->rd;
+    src1 = R(ops->rs1);
+    src2 = R(ops->rs2);
+    imm = ops->imm;
+    goto *(ops->handler);
+  }
+#endif
 
   INSTPAT_START();
   // ----下面是添加的指令-----------------
@@ -124,7 +249,8 @@ static int decode_exec(Decode *s)
   INSTPAT("??????? ????? ????? 000 ????? 00100 11", addi, I, R(rd) = src1 + imm);
 
   // jal	ra,80000018   将 PC+4 的值保存到 rd 寄存器中，然后设置 PC = PC + offset  拿到的imm要左移一位
-  INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal, J, imm = imm << 1, R(rd) = s->pc + 4, s->dnpc = s->pc + imm);
+  INSTPAT("??????? ????? ????? ??? ????? 11011 11", jal, J, imm = imm << 1, R(rd) = s->pc + 4, s->dnpc = s->pc + imm;
+          IFDEF(CONFIG_FTRACE, ftrace_jump_idiom(s, rd, false)); BBV_END(s));
 
   //           rs2=ra  rs1=sp
   // 0000 000(0 0001) (0001 0)(010) (0110 0)(010 0011)
@@ -134,7 +260,8 @@ static int decode_exec(Decode *s)
   // ret # 函数返回，等效于 jr ra，等效于 jalr x0, ra, 0
   // 0000 0000 0000 (0000 1)(000) (0000 0)(110 0111)
   // 00008067          	ret
-  INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr, I, R(rd) = s->pc + 4, s->dnpc = src1 + imm);
+  INSTPAT("??????? ????? ????? 000 ????? 11001 11", jalr, I, R(rd) = s->pc + 4, s->dnpc = src1 + imm;
+          IFDEF(CONFIG_FTRACE, ftrace_jump_idiom(s, rd, true)); BBV_END(s));
 
   // ----上面是添加的指令--------------------------
 
@@ -142,18 +269,80 @@ static int decode_exec(Decode *s)
   INSTPAT("??????? ????? ????? 100 ????? 00000 11", lbu, I, R(rd) = Mr(src1 + imm, 1));
   INSTPAT("??????? ????? ????? 000 ????? 01000 11", sb, S, Mw(src1 + imm, 1, src2));
 
+  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw, I, csr_access(s, rd, imm, src1, false, true));
+  // csrrs with rs1 = $zero only reads
+  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs, I,
+          csr_access(s, rd, imm, src1, true, BITS(s->isa.inst.val, 19, 15) != 0));
+  INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence_vma, N, tlb_flush());
+
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak, N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv, N, INV(s->pc));
   INSTPAT_END();
 
   R(0) = 0; // reset $zero to 0
 
-  return 0;
+#ifdef PREDECODE
+  if (nr_op > 0)
+  {
+    nr_exec++;
+    if (nr_exec < nr_op && s->dnpc == s->snpc && nemu_state.state == NEMU_RUNNING)
+    {
+      ops++;
+      goto next_op;
+    }
+    return nr_exec;
+  }
+#endif
+
+  return 1;
 }
 
 int isa_exec_once(Decode *s)
 {
+#ifdef CONFIG_ICACHE
+  // the cache is keyed by virtual pc, so it is only used without paging
+  if (likely(isa_mmu_check(s->pc, 4, MEM_TYPE_IFETCH) == MMU_DIRECT))
+  {
+    ICacheEntry *e = icache_entry(s->pc);
+    if (unlikely(e->handler == NULL || e->pc != s->pc))
+    {
+      s->isa.inst.val = inst_fetch(&s->snpc, 4);
+      decode_exec(s, e, 0);
+      icache_mark_page(s->pc);
+    }
+    return decode_exec(s, e, 1);
+  }
+#endif
   // 因为是riscv32 所以这里的传值是4
   s->isa.inst.val = inst_fetch(&s->snpc, 4); // 拿到当前pc指向内存的数据,一条指令
-  return decode_exec(s);                     // 对指令译码
+  return decode_exec(s, NULL, 0);            // 对指令译码
+}
+
+#ifdef CONFIG_ENGINE_TB
+bool isa_decode_once(Decode *s, ICacheEntry *op, bool *direct)
+{
+  s->snpc = s->pc;
+  s->isa.inst.val = inst_fetch(&s->snpc, 4);
+  decode_exec(s, op, 0);
+
+  // control flow instructions end a basic block,
+  // only jal and conditional branches have static targets
+  switch (BITS(s->isa.inst.val, 6, 0))
+  {
+  case 0x6f: // jal
+  case 0x63: // branch
+    *direct = true;
+    return true;
+  case 0x67: // jalr
+  case 0x73: // system
+    *direct = false;
+    return true;
+  }
+  return false;
+}
+
+int isa_exec_ops(Decode *s, ICacheEntry *ops, int nr_op)
+{
+  return decode_exec(s, ops, nr_op);
 }
+#endif
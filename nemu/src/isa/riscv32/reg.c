@@ -32,6 +32,7 @@ void isa_reg_display() {
     printf("%s=%x     %d\n", regs[i], cpu.gpr[i], cpu.gpr[i]);
   }
   printf("pc=0x%x     %d\n", cpu.pc, cpu.pc);
+  printf("satp=0x%x     %d\n", cpu.satp, cpu.satp);
 }
 
 // 返回名为s的寄存器的值
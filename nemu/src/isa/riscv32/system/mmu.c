@@ -17,6 +17,83 @@
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
 
+// Sv32 page table entry
+#define PTE_V 0x01
+#define PTE_R 0x02
+#define PTE_W 0x04
+#define PTE_X 0x08
+#define PTE_A 0x40
+#define PTE_D 0x80
+#define PTE_PPN(pte) ((pte) >> 10)
+
+// A direct-mapped software TLB, split into the instruction side and the
+// data side, so that fetches and data accesses do not evict each other.
+// Each entry maps a 4 KiB page, a superpage is cached page by page.
+#define TLB_BITS 8
+#define TLB_SIZE (1 << TLB_BITS)
+
+typedef struct {
+  uint32_t vpn;
+  uint32_t ppn;
+  bool valid;
+  bool writable;  // both W and D are set, so that a store can hit
+} TLBEntry;
+
+static TLBEntry itlb[TLB_SIZE] = {};
+static TLBEntry dtlb[TLB_SIZE] = {};
+
+// called when satp is written or by sfence.vma
+void tlb_flush() {
+  memset(itlb, 0, sizeof(itlb));
+  memset(dtlb, 0, sizeof(dtlb));
+}
+
+// walk the page table for `vaddr` and fill the TLB entry,
+// return false if the access causes a page fault
+static bool tlb_fill(TLBEntry *e, vaddr_t vaddr, int type) {
+  uint32_t vpn = vaddr >> PAGE_SHIFT;
+  paddr_t pte_addr = 0;
+  uint32_t pte = 0;
+  paddr_t base = (paddr_t)(cpu.satp & 0x3fffff) << PAGE_SHIFT;
+  int level;
+  for (level = 1; level >= 0; level --) {
+    pte_addr = base + ((vpn >> (level * 10)) & 0x3ff) * 4;
+    pte = paddr_read(pte_addr, 4);
+    if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W))) { return false; }
+    if (pte & (PTE_R | PTE_X)) { break; }
+    base = (paddr_t)PTE_PPN(pte) << PAGE_SHIFT;
+  }
+  if (level < 0) { return false; }
+
+  uint32_t ppn = PTE_PPN(pte);
+  if (level == 1) {
+    // a superpage should be aligned to 4 MiB
+    if (ppn & 0x3ff) { return false; }
+    ppn |= vpn & 0x3ff;
+  }
+
+  switch (type) {
+    case MEM_TYPE_IFETCH: if (!(pte & PTE_X)) { return false; } break;
+    case MEM_TYPE_READ:   if (!(pte & PTE_R)) { return false; } break;
+    case MEM_TYPE_WRITE:  if (!(pte & PTE_W)) { return false; } break;
+  }
+
+  // update A and D by hardware
+  uint32_t new_pte = pte | PTE_A | (type == MEM_TYPE_WRITE ? PTE_D : 0);
+  if (new_pte != pte) { paddr_write(pte_addr, 4, new_pte); }
+
+  *e = (TLBEntry){ .vpn = vpn, .ppn = ppn, .valid = true,
+    .writable = (new_pte & (PTE_W | PTE_D)) == (PTE_W | PTE_D) };
+  return true;
+}
+
+// return the physical page of `vaddr` with MEM_RET_* in the low bits
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
-  return MEM_RET_FAIL;
+  uint32_t vpn = vaddr >> PAGE_SHIFT;
+  TLBEntry *e = &(type == MEM_TYPE_IFETCH ? itlb : dtlb)[vpn & (TLB_SIZE - 1)];
+  if (unlikely(!e->valid || e->vpn != vpn || (type == MEM_TYPE_WRITE && !e->writable))) {
+    if (!tlb_fill(e, vaddr, type)) { return MEM_RET_FAIL; }
+  }
+  paddr_t pg = (paddr_t)e->ppn << PAGE_SHIFT;
+  return pg | ((vaddr & PAGE_MASK) + len > PAGE_SIZE ? MEM_RET_CROSS_PAGE : MEM_RET_OK);
 }
@@ -0,0 +1,156 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#define _GNU_SOURCE  // for the register names in ucontext_t
+#include <isa.h>
+#include <memory/paddr.h>
+
+#ifdef CONFIG_PMEM_GUARD
+
+#include <signal.h>
+#include <ucontext.h>
+
+// The SIGSEGV handler of the guard region. A fault in pmem comes from a page
+// untouched yet, which is filled and read again. Other faults are reads from
+// MMIO or out of pmem. The faulting host instruction is decoded to emulate
+// the read with paddr_read(), and then skipped. Only the plain loads
+// generated by phys_read() are supported.
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error The guard region is only supported on x86-64 Linux hosts
+#endif
+#ifdef PMEM64
+#error The guard region only covers the 32-bit physical space
+#endif
+
+// ModRM and SIB numbers of x86-64 registers to their places in gregs
+static const int greg_idx[16] = {
+  REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+  REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+typedef struct {
+  int len;       // length of the instruction
+  int size;      // bytes read
+  int dst_size;  // bytes of the destination register
+  int reg;       // destination register
+  bool sign;     // sign-extend the value read
+  uint64_t ea;   // effective address
+} HostLoad;
+
+static inline greg_t *greg(ucontext_t *uc, int r) { return &uc->uc_mcontext.gregs[greg_idx[r]]; }
+
+static bool decode_load(ucontext_t *uc, HostLoad *l) {
+  const uint8_t *p = (const uint8_t *)uc->uc_mcontext.gregs[REG_RIP];
+  const uint8_t *start = p;
+  bool opsize16 = false;
+  uint8_t rex = 0;
+
+  if (*p == 0x66) { opsize16 = true; p ++; }
+  if ((*p & 0xf0) == 0x40) { rex = *p ++; }
+  int wsize = (rex & 0x8) ? 8 : (opsize16 ? 2 : 4);
+
+  *l = (HostLoad){ .dst_size = wsize };
+  switch (*p ++) {
+    case 0x8a: l->size = l->dst_size = 1; break;  // mov r8, m8
+    case 0x8b: l->size = wsize; break;            // mov r, m
+    case 0x63: l->size = 4; l->sign = true; break;  // movsxd r, m32
+    case 0x0f:
+      switch (*p ++) {
+        case 0xb6: l->size = 1; break;            // movzx r, m8
+        case 0xb7: l->size = 2; break;            // movzx r, m16
+        case 0xbe: l->size = 1; l->sign = true; break;  // movsx r, m8
+        case 0xbf: l->size = 2; l->sign = true; break;  // movsx r, m16
+        default: return false;
+      }
+      break;
+    default: return false;
+  }
+
+  uint8_t modrm = *p ++;
+  int mod = modrm >> 6, rm = modrm & 7;
+  if (mod == 3 || (mod == 0 && rm == 5)) { return false; }  // no register or rip-relative operand
+  l->reg = ((modrm >> 3) & 7) | ((rex & 0x4) << 1);
+  // ah, ch, dh and bh are not supported
+  if (l->dst_size == 1 && rex == 0 && l->reg >= 4) { return false; }
+
+  if (rm == 4) {
+    uint8_t sib = *p ++;
+    int index = ((sib >> 3) & 7) | ((rex & 0x2) << 2);
+    if (index != 4) { l->ea += *greg(uc, index) << (sib >> 6); }
+    if ((sib & 7) == 5 && mod == 0) { l->ea += *(int32_t *)p; p += 4; }
+    else { l->ea += *greg(uc, (sib & 7) | ((rex & 0x1) << 3)); }
+  } else {
+    l->ea += *greg(uc, rm | ((rex & 0x1) << 3));
+  }
+  if (mod == 1) { l->ea += *(int8_t *)p; p += 1; }
+  else if (mod == 2) { l->ea += *(int32_t *)p; p += 4; }
+
+  l->len = p - start;
+  return true;
+}
+
+static void write_dst(ucontext_t *uc, HostLoad *l, uint64_t val) {
+  greg_t *r = greg(uc, l->reg);
+  switch (l->size) {
+    case 1: val = (l->sign ? (uint64_t)(int8_t)val  : (uint8_t)val);  break;
+    case 2: val = (l->sign ? (uint64_t)(int16_t)val : (uint16_t)val); break;
+    case 4: val = (l->sign ? (uint64_t)(int32_t)val : (uint32_t)val); break;
+  }
+  switch (l->dst_size) {
+    case 1: *r = (*r & ~0xffull) | (val & 0xff); break;
+    case 2: *r = (*r & ~0xffffull) | (val & 0xffff); break;
+    case 4: *r = (uint32_t)val; break;  // writing a 32-bit register clears the upper half
+    default: *r = val; break;
+  }
+}
+
+static struct sigaction old_sa = {};
+
+static void guard_handler(int sig, siginfo_t *info, void *ucontext) {
+  ucontext_t *uc = ucontext;
+  uint8_t *host = info->si_addr;
+  if (host < guard_base || host >= guard_base + GUARD_MAP_SIZE) {
+    // not an access to the guest, let the previous handler see it
+    sigaction(SIGSEGV, &old_sa, NULL);
+    return;
+  }
+
+  // the page after the space only holds the end of a read crossing into it
+  paddr_t fault = host - guard_base;
+  if (host < guard_base + GUARD_SIZE && in_pmem(fault)) {
+    paddr_touch(fault, 1);
+    if (ppage_r[fault >> PAGE_SHIFT] != NULL) { return; }
+  }
+
+  HostLoad l;
+  Assert(decode_load(uc, &l), "can not emulate the host instruction at %p reading guest address "
+      FMT_PADDR " at pc = " FMT_WORD, (void *)uc->uc_mcontext.gregs[REG_RIP], fault, cpu.pc);
+  // the read may start in the page before the faulting one
+  write_dst(uc, &l, paddr_read((uint8_t *)l.ea - guard_base, l.size));
+  uc->uc_mcontext.gregs[REG_RIP] += l.len;
+}
+
+void init_guard() {
+  struct sigaction sa = {};
+  sa.sa_sigaction = guard_handler;
+  // devices may fault again when emulating a read
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  int ret = sigaction(SIGSEGV, &sa, &old_sa);
+  assert(ret == 0);
+}
+
+#endif
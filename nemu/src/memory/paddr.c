@@ -16,24 +16,123 @@
 #include <memory/host.h>
 #include <memory/paddr.h>
 #include <device/mmio.h>
+#include <cpu/icache.h>
 #include <isa.h>
+#ifdef CONFIG_ENGINE_TB
+#include "tb.h"
+#endif
+#if defined(CONFIG_PMEM_MMAP) || defined(CONFIG_PMEM_GUARD)
+#include <sys/mman.h>
+#define PMEM_MAPPABLE  // pages of pmem can be replaced with mmap()
+#endif
+#include <unistd.h>
 
-#if   defined(CONFIG_PMEM_MALLOC)
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP) || defined(CONFIG_PMEM_GUARD)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 #endif
 
-uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
+#ifdef CONFIG_MEM_RANDOM
+// A page of pmem is filled with the random value at its first access,
+// so that the memory untouched by the guest costs neither time nor RSS.
+// It is only mapped for direct access after that.
+static uint8_t pmem_ready[CONFIG_MSIZE / PAGE_SIZE] = {};
+static uint8_t pmem_fill = 0;
+#endif
+
+#ifdef CONFIG_PMEM_GUARD
+uint8_t *guard_base = NULL;
+void init_guard();
+#endif
+
+#ifndef PMEM64
+uint8_t *ppage_r[NR_PPAGE] = {};
+uint8_t *ppage_w[NR_PPAGE] = {};
+#endif
+
+#ifdef CONFIG_CHECKPOINT
+// Whether a page of pmem is written since the last paddr_clean(). A clean
+// page is left out of ppage_w, so that its first write goes through
+// pmem_write() to mark it. The pages protected by paddr_protect_page()
+// are remembered, since they stay out of ppage_w once dirty.
+static uint8_t pmem_dirty[CONFIG_MSIZE / PAGE_SIZE] = {};
+static uint8_t pmem_wprot[CONFIG_MSIZE / PAGE_SIZE] = {};
+#endif
+
+// whether the writes to the page of pmem at `addr` may skip paddr_write()
+static inline bool pmem_write_direct(paddr_t addr) {
+#ifdef CONFIG_CHECKPOINT
+  uint64_t i = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  return pmem_dirty[i] && !pmem_wprot[i];
+#else
+  return true;
+#endif
+}
+
+#ifdef CONFIG_CHECKPOINT
+static void pmem_set_dirty(paddr_t addr) {
+  uint64_t i = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  if (likely(pmem_dirty[i])) return;
+  pmem_dirty[i] = 1;
+#ifndef PMEM64
+  // the later writes go directly
+  if (!pmem_wprot[i]) { ppage_w[addr >> PAGE_SHIFT] = ppage_r[addr >> PAGE_SHIFT]; }
+#endif
+}
+#endif
+
+void paddr_touch(paddr_t addr, uint64_t len) {
+#ifdef CONFIG_MEM_RANDOM
+  if (len == 0) return;
+  uint64_t first = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  uint64_t last = (addr - CONFIG_MBASE + len - 1) >> PAGE_SHIFT;
+  for (uint64_t i = first; i <= last; i ++) {
+    if (likely(pmem_ready[i])) continue;
+    pmem_ready[i] = 1;
+    paddr_map_host(CONFIG_MBASE + i * PAGE_SIZE, PAGE_SIZE, pmem + i * PAGE_SIZE);
+    memset(pmem + i * PAGE_SIZE, pmem_fill, PAGE_SIZE);
+  }
+#endif
+}
+
+#ifdef PMEM_MAPPABLE
+// the pages in [addr, addr + len) are given their contents without filling
+static void pmem_set_ready(paddr_t addr, uint64_t len) {
+  IFDEF(CONFIG_MEM_RANDOM, memset(&pmem_ready[(addr - CONFIG_MBASE) >> PAGE_SHIFT], 1, len >> PAGE_SHIFT));
+  paddr_map_host(addr, len, pmem + addr - CONFIG_MBASE);
+}
+#endif
+
+static inline uint8_t* pmem_touch(paddr_t addr, int len) {
+#ifdef CONFIG_MEM_RANDOM
+  if (unlikely(!pmem_ready[(addr - CONFIG_MBASE) >> PAGE_SHIFT] ||
+        !pmem_ready[(addr - CONFIG_MBASE + len - 1) >> PAGE_SHIFT])) {
+    paddr_touch(addr, len);
+  }
+#endif
+  return pmem + addr - CONFIG_MBASE;
+}
+
+uint8_t* guest_to_host(paddr_t paddr) { return in_pmem(paddr) ? pmem_touch(paddr, 1) : pmem + paddr - CONFIG_MBASE; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
 static word_t pmem_read(paddr_t addr, int len) {
-  word_t ret = host_read(guest_to_host(addr), len);
+  word_t ret = host_read(pmem_touch(addr, len), len);
   return ret;
 }
 
 static void pmem_write(paddr_t addr, int len, word_t data) {
-  host_write(guest_to_host(addr), len, data);
+  IFDEF(CONFIG_CHECKPOINT, pmem_set_dirty(addr));
+  IFDEF(CONFIG_CHECKPOINT, pmem_set_dirty(addr + len - 1));
+  IFDEF(CONFIG_ICACHE, icache_check_write(addr, len));
+  IFDEF(CONFIG_ENGINE_TB, tb_check_write(addr, len));
+  host_write(pmem_touch(addr, len), len, data);
+}
+
+// [addr, addr + len) is in pmem, without wrapping around the address space
+static bool in_pmem_range(paddr_t addr, uint64_t len) {
+  return in_pmem(addr) && len <= (uint64_t)(PMEM_RIGHT - addr) + 1;
 }
 
 static void out_of_bound(paddr_t addr) {
@@ -45,8 +144,24 @@ void init_mem() {
 #if   defined(CONFIG_PMEM_MALLOC)
   pmem = malloc(CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_MMAP)
+  // the host only allocates the pages touched
+  pmem = mmap(NULL, CONFIG_MSIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(pmem != MAP_FAILED);
+#elif defined(CONFIG_PMEM_GUARD)
+  // pages are only accessible after mapped by paddr_map_host()
+  guard_base = mmap(NULL, GUARD_MAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(guard_base != MAP_FAILED);
+  pmem = guard_base + CONFIG_MBASE;
+  init_guard();
+#endif
+  IFDEF(CONFIG_CHECKPOINT, memset(pmem_dirty, 1, sizeof(pmem_dirty)));
+#ifdef CONFIG_MEM_RANDOM
+  pmem_fill = rand();
+#else
+  paddr_map_host(CONFIG_MBASE, CONFIG_MSIZE, pmem);
 #endif
-  IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
@@ -62,3 +177,117 @@ void paddr_write(paddr_t addr, int len, word_t data) {
   IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
   out_of_bound(addr);
 }
+
+void paddr_load_file(paddr_t addr, uint64_t len, int fd, uint64_t off) {
+  if (len == 0) return;
+  Assert(in_pmem_range(addr, len), "[" FMT_PADDR ", " FMT_PADDR ") is out of pmem", addr, addr + (paddr_t)len);
+  uint64_t head = len, body = 0;
+#ifdef PMEM_MAPPABLE
+  if (((addr - off) & PAGE_MASK) == 0) {
+    head = -addr & PAGE_MASK;
+    if (head > len) { head = len; }
+    body = (len - head) & ~PAGE_MASK;
+  }
+  if (body > 0) {
+    void *p = mmap(pmem + addr + head - CONFIG_MBASE, body, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, fd, off + head);
+    Assert(p != MAP_FAILED, "fail to map the file to pmem");
+    pmem_set_ready(addr + head, body);
+  }
+#endif
+  // the partial pages at both ends are shared with other contents
+  uint64_t tail = head + body;
+  paddr_touch(addr, head);
+  paddr_touch(addr + tail, len - tail);
+  bool ok = pread(fd, pmem + addr - CONFIG_MBASE, head, off) == head &&
+    pread(fd, pmem + addr + tail - CONFIG_MBASE, len - tail, off + tail) == len - tail;
+  Assert(ok, "fail to read the file to pmem");
+}
+
+void paddr_zero(paddr_t addr, uint64_t len) {
+  if (len == 0) return;
+  Assert(in_pmem_range(addr, len), "[" FMT_PADDR ", " FMT_PADDR ") is out of pmem", addr, addr + (paddr_t)len);
+  uint64_t head = len, body = 0;
+#ifdef PMEM_MAPPABLE
+  head = -addr & PAGE_MASK;
+  if (head > len) { head = len; }
+  body = (len - head) & ~PAGE_MASK;
+  if (body > 0) {
+    // fresh anonymous pages read as zero, and are only allocated when touched
+    void *p = mmap(pmem + addr + head - CONFIG_MBASE, body, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    Assert(p != MAP_FAILED, "fail to map zero pages to pmem");
+    pmem_set_ready(addr + head, body);
+  }
+#endif
+  uint64_t tail = head + body;
+  paddr_touch(addr, head);
+  memset(pmem + addr - CONFIG_MBASE, 0, head);
+  paddr_touch(addr + tail, len - tail);
+  memset(pmem + addr + tail - CONFIG_MBASE, 0, len - tail);
+}
+
+void paddr_map_host(paddr_t addr, uint64_t len, uint8_t *host) {
+#ifndef PMEM64
+  uint64_t first = ((uint64_t)addr + PAGE_MASK) >> PAGE_SHIFT;
+  uint64_t last = ((uint64_t)addr + len) >> PAGE_SHIFT;
+  host += (first << PAGE_SHIFT) - addr;
+#ifdef CONFIG_PMEM_GUARD
+  if (host >= guard_base && host < guard_base + GUARD_SIZE && last > first) {
+    int ret = mprotect(host, (last - first) << PAGE_SHIFT, PROT_READ | PROT_WRITE);
+    assert(ret == 0);
+  }
+#endif
+  for (uint64_t i = first; i < last; i ++, host += PAGE_SIZE) {
+    paddr_t page = i << PAGE_SHIFT;
+    ppage_r[i] = host;
+    ppage_w[i] = (in_pmem(page) && !pmem_write_direct(page) ? NULL : host);
+  }
+#endif
+}
+
+void paddr_protect_page(paddr_t addr, bool protect) {
+#ifndef PMEM64
+  uint64_t i = addr >> PAGE_SHIFT;
+  IFDEF(CONFIG_CHECKPOINT, pmem_wprot[(addr - CONFIG_MBASE) >> PAGE_SHIFT] = protect);
+  ppage_w[i] = (protect || !pmem_write_direct(addr) ? NULL : ppage_r[i]);
+#endif
+}
+
+#ifdef CONFIG_CHECKPOINT
+bool paddr_page_dirty(paddr_t addr) {
+  return pmem_dirty[(addr - CONFIG_MBASE) >> PAGE_SHIFT];
+}
+
+bool paddr_page_ready(paddr_t addr) {
+  return MUXDEF(CONFIG_MEM_RANDOM, pmem_ready[(addr - CONFIG_MBASE) >> PAGE_SHIFT], true);
+}
+
+void paddr_clean() {
+  memset(pmem_dirty, 0, sizeof(pmem_dirty));
+#ifndef PMEM64
+  memset(&ppage_w[CONFIG_MBASE >> PAGE_SHIFT], 0, sizeof(ppage_w[0]) * (CONFIG_MSIZE / PAGE_SIZE));
+#endif
+}
+
+void paddr_reset() {
+#ifdef PMEM_MAPPABLE
+  // drop all the pages, including those mapped from files
+  void *p = mmap(pmem, CONFIG_MSIZE, MUXDEF(CONFIG_PMEM_GUARD, PROT_NONE, PROT_READ | PROT_WRITE),
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  Assert(p != MAP_FAILED, "fail to reset pmem");
+#else
+  memset(pmem, 0, CONFIG_MSIZE);
+#endif
+  memset(pmem_dirty, 1, sizeof(pmem_dirty));
+#ifdef CONFIG_MEM_RANDOM
+  memset(pmem_ready, 0, sizeof(pmem_ready));
+#ifndef PMEM64
+  memset(&ppage_r[CONFIG_MBASE >> PAGE_SHIFT], 0, sizeof(ppage_r[0]) * (CONFIG_MSIZE / PAGE_SIZE));
+  memset(&ppage_w[CONFIG_MBASE >> PAGE_SHIFT], 0, sizeof(ppage_w[0]) * (CONFIG_MSIZE / PAGE_SIZE));
+#endif
+#else
+  paddr_map_host(CONFIG_MBASE, CONFIG_MSIZE, pmem);
+#endif
+}
+#endif
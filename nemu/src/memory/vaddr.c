@@ -14,16 +14,79 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <utils/btrace.h>
 
-word_t vaddr_ifetch(vaddr_t addr, int len) {
+#ifdef CONFIG_PMEM_GUARD
+// reads other than RAM fault and are emulated by the SIGSEGV handler,
+// volatile keeps each of them a single load it can decode
+static inline word_t phys_read(paddr_t addr, int len) {
+  volatile void *p = guard_base + addr;
+  switch (len) {
+    case 1: return *(volatile uint8_t  *)p;
+    case 2: return *(volatile uint16_t *)p;
+    default: return *(volatile uint32_t *)p;
+  }
+}
+#else
+static inline word_t phys_read(paddr_t addr, int len) {
+  uint8_t *host = ppage_host(addr, len, false);
+  if (likely(host != NULL)) return host_read(host, len);
   return paddr_read(addr, len);
 }
+#endif
+
+// writes still check ppage_w, which also catches the writes to cached code
+
+static inline void phys_write(paddr_t addr, int len, word_t data) {
+  uint8_t *host = ppage_host(addr, len, true);
+  if (likely(host != NULL)) { host_write(host, len, data); return; }
+  paddr_write(addr, len, data);
+}
+
+// return the physical page of `addr` with MEM_RET_* in the low bits
+static paddr_t translate(vaddr_t addr, int len, int type) {
+  paddr_t pg = isa_mmu_translate(addr, len, type);
+  Assert((pg & PAGE_MASK) != MEM_RET_FAIL, "page fault at vaddr = " FMT_WORD ", type = %d, pc = " FMT_WORD,
+      addr, type, cpu.pc);
+  return pg;
+}
+
+// an access crossing a page is split into bytes,
+// since the two pages may not be adjacent in physical memory
+static word_t mmu_read(vaddr_t addr, int len, int type) {
+  paddr_t pg = translate(addr, len, type);
+  if (unlikely((pg & PAGE_MASK) == MEM_RET_CROSS_PAGE)) {
+    word_t ret = 0;
+    for (int i = 0; i < len; i ++) { ret |= mmu_read(addr + i, 1, type) << (i * 8); }
+    return ret;
+  }
+  return phys_read((pg & ~PAGE_MASK) | (addr & PAGE_MASK), len);
+}
+
+static void mmu_write(vaddr_t addr, int len, word_t data) {
+  paddr_t pg = translate(addr, len, MEM_TYPE_WRITE);
+  if (unlikely((pg & PAGE_MASK) == MEM_RET_CROSS_PAGE)) {
+    for (int i = 0; i < len; i ++) { mmu_write(addr + i, 1, data >> (i * 8)); }
+    return;
+  }
+  phys_write((pg & ~PAGE_MASK) | (addr & PAGE_MASK), len, data);
+}
+
+word_t vaddr_ifetch(vaddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) == MMU_DIRECT) return phys_read(addr, len);
+  return mmu_read(addr, len, MEM_TYPE_IFETCH);
+}
 
 word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  IFDEF(CONFIG_BTRACE_MEM, if (unlikely(btrace_on)) btrace_mem(addr, len, false));
+  if (isa_mmu_check(addr, len, MEM_TYPE_READ) == MMU_DIRECT) return phys_read(addr, len);
+  return mmu_read(addr, len, MEM_TYPE_READ);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+  IFDEF(CONFIG_BTRACE_MEM, if (unlikely(btrace_on)) btrace_mem(addr, len, true));
+  if (isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT) { phys_write(addr, len, data); return; }
+  mmu_write(addr, len, data);
 }
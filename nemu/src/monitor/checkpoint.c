@@ -0,0 +1,453 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <cpu/difftest.h>
+#include <cpu/icache.h>
+#include <monitor/checkpoint.h>
+
+#ifdef CONFIG_CHECKPOINT
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// A checkpoint file holds the whole machine:
+//   header | path of the parent | cpu | nemu_state | device blobs | page table | pages
+// A checkpoint with a parent is incremental, and only holds the pages written
+// since the parent is saved or restored, so that restoring it needs the chain
+// of its parents to stay unchanged. Each page is stored as zero (size 0),
+// uncompressed (size PAGE_SIZE) or by zlib. The uncompressed pages of a raw
+// checkpoint are page aligned in the file, so that they are mapped to pmem
+// rather than read when pmem is mmap()ed.
+
+#define CKPT_MAGIC "NEMUCKPT"
+#define CKPT_VERSION 1
+#define CKPT_RAW 1       // flag: the pages are not compressed
+#define CKPT_CHAIN_MAX 64
+#define NR_PMEM_PAGE (CONFIG_MSIZE / PAGE_SIZE)
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  char isa[16];
+  uint64_t mbase, msize;
+  uint32_t page_size, cpu_size;
+  uint64_t nr_inst;    // g_nr_guest_inst
+  uint64_t time;       // get_time()
+  uint64_t page_table; // offset of the page table
+  uint32_t nr_page, nr_dev;
+  uint32_t parent_len; // the path of the parent follows the header, no parent if 0
+  uint32_t pad;
+} CkptHeader;
+
+typedef struct {
+  char name[32];
+  uint32_t size;
+  uint32_t stored; // compressed if smaller than size
+} CkptBlob;
+
+typedef struct {
+  uint32_t index;  // page of pmem
+  uint32_t size;   // 0 for a zero page, PAGE_SIZE if not compressed
+  uint64_t offset;
+} CkptPage;
+
+#define NR_CKPT_DEV 32
+
+static struct {
+  const char *name;
+  void *ptr;
+  size_t size;
+  void (*restore)();
+} ckpt_dev[NR_CKPT_DEV];
+static int nr_ckpt_dev = 0;
+
+// the checkpoint saved or restored last, which the dirty pages are relative to
+static char *ckpt_parent = NULL;
+
+// --checkpoint
+uint64_t ckpt_next = UINT64_MAX;
+static uint64_t ckpt_period = 0;
+static char *ckpt_file = NULL;
+static bool ckpt_file_raw = false;
+
+extern uint64_t g_nr_guest_inst;
+void tb_flush();
+void tlb_flush();
+
+void ckpt_register(const char *name, void *ptr, size_t size, void (*restore)()) {
+  Assert(nr_ckpt_dev < NR_CKPT_DEV, "too many device states, please enlarge NR_CKPT_DEV");
+  Assert(strlen(name) < sizeof(((CkptBlob *)0)->name), "name '%s' is too long", name);
+  ckpt_dev[nr_ckpt_dev ++] = (typeof(ckpt_dev[0])){ .name = name, .ptr = ptr, .size = size, .restore = restore };
+}
+
+static bool page_is_zero(const uint8_t *p) {
+  const uint64_t *q = (const uint64_t *)p;
+  for (int i = 0; i < PAGE_SIZE / sizeof(q[0]); i ++) {
+    if (q[i] != 0) return false;
+  }
+  return true;
+}
+
+// ----------- save -----------
+
+typedef struct {
+  int fd;
+  uint64_t off;
+  bool ok;
+} CkptWriter;
+
+static void put(CkptWriter *w, const void *buf, size_t len) {
+  if (w->ok && pwrite(w->fd, buf, len, w->off) != len) { w->ok = false; }
+  w->off += len;
+}
+
+// compressed if it helps, return the size stored
+static uint32_t put_compressed(CkptWriter *w, const void *buf, size_t len) {
+  static uint8_t *out = NULL;
+  static uLong out_size = 0;
+  if (out_size < compressBound(len)) {
+    out_size = compressBound(len);
+    out = realloc(out, out_size);
+    assert(out);
+  }
+  uLongf size = out_size;
+  if (compress2(out, &size, buf, len, Z_BEST_SPEED) != Z_OK || size >= len) {
+    put(w, buf, len);
+    return len;
+  }
+  put(w, out, size);
+  return size;
+}
+
+// the pages to save, the whole pmem without a parent
+static int collect_pages(CkptPage *pages, bool full) {
+  int n = 0;
+  for (uint32_t i = 0; i < NR_PMEM_PAGE; i ++) {
+    paddr_t addr = CONFIG_MBASE + i * PAGE_SIZE;
+    if (!paddr_page_ready(addr) || (!full && !paddr_page_dirty(addr))) continue;
+    bool zero = page_is_zero(guest_to_host(addr));
+    // pmem is reset to zero before the pages are restored,
+    // but the untouched pages do not read as zero with CONFIG_MEM_RANDOM
+    if (zero && full && !ISDEF(CONFIG_MEM_RANDOM)) continue;
+    pages[n ++] = (CkptPage){ .index = i, .size = (zero ? 0 : PAGE_SIZE) };
+  }
+  return n;
+}
+
+static bool ckpt_write(const char *file, bool raw) {
+  int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+
+  CkptPage *pages = malloc(sizeof(pages[0]) * NR_PMEM_PAGE);
+  assert(pages);
+  int nr_page = collect_pages(pages, ckpt_parent == NULL);
+
+  CkptHeader h = {
+    .magic = CKPT_MAGIC, .version = CKPT_VERSION, .flags = (raw ? CKPT_RAW : 0),
+    .isa = CONFIG_ISA, .mbase = CONFIG_MBASE, .msize = CONFIG_MSIZE,
+    .page_size = PAGE_SIZE, .cpu_size = sizeof(cpu),
+    .nr_inst = g_nr_guest_inst, .time = get_time(),
+    .nr_page = nr_page, .nr_dev = nr_ckpt_dev,
+    .parent_len = (ckpt_parent == NULL ? 0 : strlen(ckpt_parent)),
+  };
+  CkptWriter w = { .fd = fd, .off = sizeof(h), .ok = true };
+  put(&w, ckpt_parent, h.parent_len);
+  put(&w, &cpu, sizeof(cpu));
+  put(&w, &nemu_state, sizeof(nemu_state));
+  for (int i = 0; i < nr_ckpt_dev; i ++) {
+    CkptBlob b = { .size = ckpt_dev[i].size };
+    strcpy(b.name, ckpt_dev[i].name);
+    uint64_t off = w.off;
+    w.off += sizeof(b);
+    b.stored = put_compressed(&w, ckpt_dev[i].ptr, b.size);
+    uint64_t end = w.off;
+    w.off = off;
+    put(&w, &b, sizeof(b));
+    w.off = end;
+  }
+
+  h.page_table = w.off;
+  w.off += sizeof(pages[0]) * nr_page;
+  if (raw) { w.off = (w.off + PAGE_MASK) & ~(uint64_t)PAGE_MASK; }
+  for (int i = 0; i < nr_page; i ++) {
+    if (pages[i].size == 0) continue;
+    pages[i].offset = w.off;
+    uint8_t *p = guest_to_host(CONFIG_MBASE + pages[i].index * PAGE_SIZE);
+    if (raw) { put(&w, p, PAGE_SIZE); }
+    else { pages[i].size = put_compressed(&w, p, PAGE_SIZE); }
+  }
+  uint64_t end = w.off;
+  w.off = h.page_table;
+  put(&w, pages, sizeof(pages[0]) * nr_page);
+  w.off = 0;
+  put(&w, &h, sizeof(h));
+  free(pages);
+
+  bool ok = w.ok && ftruncate(fd, end) == 0;
+  return (close(fd) == 0) && ok;
+}
+
+// ----------- restore -----------
+
+static bool get(int fd, void *buf, size_t len, uint64_t off) {
+  return pread(fd, buf, len, off) == len;
+}
+
+// open a checkpoint and check that this build of NEMU can restore it, -1 on errors
+static int ckpt_open(const char *file, CkptHeader *h, char **parent) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    Log("Can not open checkpoint '%s'", file);
+    return -1;
+  }
+  const char *err = NULL;
+  if (!get(fd, h, sizeof(*h), 0) || memcmp(h->magic, CKPT_MAGIC, sizeof(h->magic)) != 0) {
+    err = "not a checkpoint";
+  } else if (h->version != CKPT_VERSION) {
+    err = "unsupported version";
+  } else if (strncmp(h->isa, CONFIG_ISA, sizeof(h->isa)) != 0 || h->cpu_size != sizeof(cpu)) {
+    err = "taken on another ISA";
+  } else if (h->mbase != CONFIG_MBASE || h->msize != CONFIG_MSIZE || h->page_size != PAGE_SIZE) {
+    err = "taken with another pmem";
+  }
+  *parent = NULL;
+  if (err == NULL && h->parent_len > 0) {
+    *parent = malloc(h->parent_len + 1);
+    assert(*parent);
+    (*parent)[h->parent_len] = '\0';
+    if (!get(fd, *parent, h->parent_len, sizeof(*h))) { err = "truncated"; }
+  }
+  if (err != NULL) {
+    Log("Checkpoint '%s' is %s", file, err);
+    free(*parent);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// call `fn` for each checkpoint from `file` to its base, until it returns false
+static bool ckpt_walk(const char *file, bool (*fn)(const char *file, void *arg), void *arg) {
+  char *f = strdup(file);
+  for (int depth = 0; f != NULL; depth ++) {
+    CkptHeader h;
+    char *parent;
+    if (depth == CKPT_CHAIN_MAX) { Log("Checkpoint '%s' has too many parents", file); }
+    int fd = (depth < CKPT_CHAIN_MAX ? ckpt_open(f, &h, &parent) : -1);
+    bool more = (fd >= 0 && fn(f, arg));
+    if (fd >= 0) close(fd);
+    free(f);
+    if (!more) {
+      if (fd >= 0) free(parent);
+      return false;
+    }
+    f = parent;
+  }
+  return true;
+}
+
+static bool ckpt_walk_ok(const char *file, void *arg) { return true; }
+
+static bool ckpt_walk_differ(const char *file, void *arg) { return strcmp(file, arg) != 0; }
+
+static void get_blob(int fd, uint64_t off, void *buf, uint32_t size, uint32_t stored) {
+  bool ok;
+  if (stored == size) {
+    ok = get(fd, buf, size, off);
+  } else {
+    uint8_t *in = malloc(stored);
+    assert(in);
+    uLongf len = size;
+    ok = get(fd, in, stored, off) && uncompress(buf, &len, in, stored) == Z_OK && len == size;
+    free(in);
+  }
+  Assert(ok, "fail to read the checkpoint");
+}
+
+// the kind of a page, which is loaded together with the following pages of the same kind
+static inline int page_kind(CkptPage *p) {
+  return (p->size == 0 ? 0 : p->size == PAGE_SIZE ? 1 : 2);
+}
+
+// the base is applied first, and then the pages of each checkpoint on it
+static void load_pages(const char *file) {
+  CkptHeader h;
+  char *parent;
+  int fd = ckpt_open(file, &h, &parent);
+  Assert(fd >= 0, "fail to open checkpoint '%s'", file);
+  if (parent != NULL) {
+    load_pages(parent);
+    free(parent);
+  }
+
+  CkptPage *pages = malloc(sizeof(pages[0]) * h.nr_page);
+  assert(pages);
+  Assert(get(fd, pages, sizeof(pages[0]) * h.nr_page, h.page_table), "fail to read the checkpoint");
+  for (uint32_t i = 0, j; i < h.nr_page; i = j) {
+    paddr_t addr = CONFIG_MBASE + pages[i].index * PAGE_SIZE;
+    int kind = page_kind(&pages[i]);
+    for (j = i + 1; j < h.nr_page && kind != 2 && page_kind(&pages[j]) == kind &&
+        pages[j].index == pages[j - 1].index + 1 &&
+        (kind == 0 || pages[j].offset == pages[j - 1].offset + PAGE_SIZE); j ++);
+    switch (kind) {
+      case 0: paddr_zero(addr, (uint64_t)(j - i) * PAGE_SIZE); break;
+      case 1: paddr_load_file(addr, (uint64_t)(j - i) * PAGE_SIZE, fd, pages[i].offset); break;
+      default: get_blob(fd, pages[i].offset, guest_to_host(addr), PAGE_SIZE, pages[i].size); break;
+    }
+  }
+  free(pages);
+  // the mapped pages stay after the file is closed
+  close(fd);
+}
+
+static void load_state(const char *file) {
+  CkptHeader h;
+  char *parent;
+  int fd = ckpt_open(file, &h, &parent);
+  Assert(fd >= 0, "fail to open checkpoint '%s'", file);
+  free(parent);
+  uint64_t off = sizeof(h) + h.parent_len;
+  NEMUState state;
+  bool ok = get(fd, &cpu, sizeof(cpu), off) && get(fd, &state, sizeof(state), off + sizeof(cpu));
+  Assert(ok, "fail to read the checkpoint");
+  off += sizeof(cpu) + sizeof(state);
+  // a checkpoint taken by --checkpoint is in the middle of cpu_exec()
+  if (state.state == NEMU_RUNNING) { state.state = NEMU_STOP; }
+  nemu_state = state;
+  g_nr_guest_inst = h.nr_inst;
+  set_time(h.time);
+
+  for (uint32_t i = 0; i < h.nr_dev; i ++) {
+    CkptBlob b;
+    Assert(get(fd, &b, sizeof(b), off), "fail to read the checkpoint");
+    b.name[sizeof(b.name) - 1] = '\0';
+    int k = 0;
+    while (k < nr_ckpt_dev && strcmp(ckpt_dev[k].name, b.name) != 0) { k ++; }
+    if (k < nr_ckpt_dev && ckpt_dev[k].size == b.size) {
+      get_blob(fd, off + sizeof(b), ckpt_dev[k].ptr, b.size, b.stored);
+      if (ckpt_dev[k].restore != NULL) { ckpt_dev[k].restore(); }
+    } else {
+      Log("The state of device '%s' in the checkpoint is not restored", b.name);
+    }
+    off += sizeof(b) + b.stored;
+  }
+  close(fd);
+}
+
+// ----------- interface -----------
+
+bool ckpt_save(const char *file, bool raw) {
+  // the file is replaced at last, so that the pages mapped from it stay the same,
+  // but a checkpoint can not be incremental on itself
+  char *path = realpath(file, NULL);
+  if (path != NULL && ckpt_parent != NULL && !ckpt_walk(ckpt_parent, ckpt_walk_differ, path)) {
+    free(ckpt_parent);
+    ckpt_parent = NULL;
+  }
+  free(path);
+
+  char *tmp = malloc(strlen(file) + 5);
+  assert(tmp);
+  sprintf(tmp, "%s.tmp", file);
+  bool ok = ckpt_write(tmp, raw) && rename(tmp, file) == 0;
+  if (!ok) {
+    Log("Can not save checkpoint '%s'", file);
+    unlink(tmp);
+    free(tmp);
+    return false;
+  }
+  free(tmp);
+
+  Log("Checkpoint '%s' is saved at instruction %" PRIu64 "%s%s", file, g_nr_guest_inst,
+      (ckpt_parent == NULL ? "" : " on "), (ckpt_parent == NULL ? "" : ckpt_parent));
+  free(ckpt_parent);
+  ckpt_parent = realpath(file, NULL);
+  paddr_clean();
+  return true;
+}
+
+bool ckpt_restore(const char *file) {
+  char *path = realpath(file, NULL);
+  // check the whole chain before the machine is changed
+  if (path == NULL || !ckpt_walk(path, ckpt_walk_ok, NULL)) {
+    Log("Can not restore checkpoint '%s'", file);
+    free(path);
+    return false;
+  }
+
+  // the cached code is dropped first, since it protects its pages
+  IFDEF(CONFIG_ICACHE, icache_flush());
+  IFDEF(CONFIG_ENGINE_TB, tb_flush());
+  IFDEF(CONFIG_ISA_riscv, tlb_flush());
+  paddr_reset();
+  load_pages(path);
+  load_state(path);
+  paddr_clean();
+  free(ckpt_parent);
+  ckpt_parent = path;
+
+#ifdef CONFIG_DIFFTEST
+  ref_difftest_memcpy(CONFIG_MBASE, guest_to_host(CONFIG_MBASE), CONFIG_MSIZE, DIFFTEST_TO_REF);
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+#endif
+  Log("Checkpoint '%s' is restored at instruction %" PRIu64 ", pc = " FMT_WORD, file, g_nr_guest_inst, cpu.pc);
+  return true;
+}
+
+// called by cpu_exec() when g_nr_guest_inst reaches ckpt_next
+void ckpt_reach() {
+  if (ckpt_period == 0) {
+    ckpt_next = UINT64_MAX;
+    ckpt_save(ckpt_file, ckpt_file_raw);
+    return;
+  }
+  ckpt_next += ckpt_period;
+  char name[strlen(ckpt_file) + 24];
+  sprintf(name, "%s.%" PRIu64, ckpt_file, g_nr_guest_inst);
+  ckpt_save(name, ckpt_file_raw);
+}
+
+// "N,FILE" saves FILE after N instructions, and "+N,FILE" saves FILE.COUNT
+// every N instructions, each on the previous one. ",raw" may follow FILE.
+static bool ckpt_set_auto(const char *arg) {
+  bool periodic = (arg[0] == '+');
+  char *end;
+  uint64_t n = strtoull(arg + periodic, &end, 0);
+  if (end == arg + periodic || *end != ',' || end[1] == '\0' || (periodic && n == 0)) return false;
+  ckpt_file = strdup(end + 1);
+  size_t len = strlen(ckpt_file);
+  if (len > 4 && strcmp(ckpt_file + len - 4, ",raw") == 0) {
+    ckpt_file[len - 4] = '\0';
+    ckpt_file_raw = true;
+  }
+  ckpt_period = (periodic ? n : 0);
+  ckpt_next = (periodic ? (g_nr_guest_inst / n + 1) * n : n);
+  return true;
+}
+
+void init_checkpoint(const char *restore_file, const char *auto_arg) {
+  if (restore_file != NULL) {
+    bool ok = ckpt_restore(restore_file);
+    Assert(ok, "fail to restore checkpoint '%s'", restore_file);
+  }
+  if (auto_arg != NULL) {
+    bool ok = ckpt_set_auto(auto_arg);
+    Assert(ok, "bad checkpoint '%s'", auto_arg);
+  }
+}
+#endif
@@ -0,0 +1,124 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <utils/symtab.h>
+
+#ifndef CONFIG_TARGET_AM
+#include <elf.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef CONFIG_ISA64
+typedef Elf64_Ehdr Elf_Ehdr;
+typedef Elf64_Phdr Elf_Phdr;
+typedef Elf64_Shdr Elf_Shdr;
+typedef Elf64_Sym Elf_Sym;
+#define ELF_ST_TYPE ELF64_ST_TYPE
+#define ELF_CLASS ELFCLASS64
+#else
+typedef Elf32_Ehdr Elf_Ehdr;
+typedef Elf32_Phdr Elf_Phdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym Elf_Sym;
+#define ELF_ST_TYPE ELF32_ST_TYPE
+#define ELF_CLASS ELFCLASS32
+#endif
+
+#define ELF_MACHINE MUXDEF(CONFIG_ISA_x86, EM_386, MUXDEF(CONFIG_ISA_mips32, EM_MIPS, \
+  MUXDEF(CONFIG_ISA_riscv, EM_RISCV, EM_LOONGARCH)))
+
+// Load the PT_LOAD segments of the ELF file `fd` to their physical
+// addresses, and start from its entry point. Return the size of the
+// memory from RESET_VECTOR to the end of the segments, or -1 if it is not
+// an ELF file at all.
+long load_elf(int fd) {
+  Elf_Ehdr eh;
+  if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0) {
+    return -1;
+  }
+  Assert(eh.e_ident[EI_CLASS] == ELF_CLASS && eh.e_machine == ELF_MACHINE,
+      "The ELF file is not built for %s", str(__GUEST_ISA__));
+  Assert(eh.e_phnum > 0 && eh.e_phentsize == sizeof(Elf_Phdr),
+      "The ELF file has no program headers, or of a wrong size %d", eh.e_phentsize);
+  struct stat st;
+  int ret = fstat(fd, &st);
+  assert(ret == 0);
+
+  Elf_Phdr *ph = malloc(eh.e_phnum * sizeof(Elf_Phdr));
+  assert(ph);
+  ret = pread(fd, ph, eh.e_phnum * sizeof(Elf_Phdr), eh.e_phoff);
+  Assert(ret == eh.e_phnum * sizeof(Elf_Phdr), "The program headers are out of the ELF file");
+
+  paddr_t end = RESET_VECTOR;
+  for (int i = 0; i < eh.e_phnum; i ++) {
+    if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) { continue; }
+    paddr_t addr = ph[i].p_paddr;
+    Assert(ph[i].p_filesz <= ph[i].p_memsz,
+        "Segment %d has a file size larger than its memory size", i);
+    Assert((uint64_t)ph[i].p_offset + ph[i].p_filesz <= st.st_size,
+        "Segment %d is out of the ELF file", i);
+    Log("Load segment [" FMT_PADDR ", " FMT_PADDR "), file size = %ld",
+        addr, (paddr_t)(addr + ph[i].p_memsz), (long)ph[i].p_filesz);
+    paddr_load_file(addr, ph[i].p_filesz, fd, ph[i].p_offset);
+    // .bss, which is zero until the guest touches it
+    paddr_zero(addr + ph[i].p_filesz, ph[i].p_memsz - ph[i].p_filesz);
+    if (addr + ph[i].p_memsz > end) { end = addr + ph[i].p_memsz; }
+  }
+  free(ph);
+
+  cpu.pc = eh.e_entry;
+  Log("The entry point is " FMT_WORD, cpu.pc);
+  return end - RESET_VECTOR;
+}
+#ifdef CONFIG_SYMTAB
+// Add the functions in the symbol table of the ELF file `fd` to symtab[]. The file is known to be an ELF file for this guest.
+void load_elf_symbols(int fd) {
+  Elf_Ehdr eh;
+  int ret = pread(fd, &eh, sizeof(eh), 0);
+  assert(ret == sizeof(eh));
+  if (eh.e_shnum == 0) { symtab_build(); return; }
+  Assert(eh.e_shentsize == sizeof(Elf_Shdr), "The section headers of the ELF file are of a wrong size %d", eh.e_shentsize);
+
+  Elf_Shdr *sh = malloc(eh.e_shnum * sizeof(Elf_Shdr));
+  assert(sh);
+  ret = pread(fd, sh, eh.e_shnum * sizeof(Elf_Shdr), eh.e_shoff);
+  Assert(ret == eh.e_shnum * sizeof(Elf_Shdr), "The section headers are out of the ELF file");
+
+  for (int i = 0; i < eh.e_shnum; i ++) {
+    if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh.e_shnum) { continue; }
+    Elf_Shdr *strtab = &sh[sh[i].sh_link];
+    char *str = malloc(strtab->sh_size + 1);
+    Elf_Sym *sym = malloc(sh[i].sh_size);
+    assert(str && sym);
+    ret = pread(fd, str, strtab->sh_size, strtab->sh_offset);
+    assert(ret == strtab->sh_size);
+    str[strtab->sh_size] = '\0';
+    ret = pread(fd, sym, sh[i].sh_size, sh[i].sh_offset);
+    assert(ret == sh[i].sh_size);
+
+    for (int j = 0; j < sh[i].sh_size / sizeof(Elf_Sym); j ++) {
+      if (ELF_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_name >= strtab->sh_size) { continue; }
+      symtab_add(sym[j].st_value, sym[j].st_size, str + sym[j].st_name);
+    }
+    free(str);
+    free(sym);
+  }
+  free(sh);
+  symtab_build();
+}
+#endif
+#endif
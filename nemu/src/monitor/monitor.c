@@ -15,6 +15,7 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <utils/trace.h>
 
 void init_rand();
 void init_log(const char *log_file);
@@ -23,6 +24,25 @@ void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
 void init_disasm(const char *triple);
+void init_btrace(const char *file, const char *triple);
+void init_trace();
+void init_ftrace(const char *folded_file);
+void init_prof(const char *folded_file);
+void init_imix(const char *csv_file);
+void init_bbv(const char *file);
+void init_checkpoint(const char *restore_file, const char *auto_arg);
+void init_sample(const char *arg, const char *len, const char *jobs, const char *ckpt);
+
+#ifndef CONFIG_ISA_loongarch32r
+#define DISASM_TRIPLE MUXDEF(CONFIG_ISA_x86,     "i686", \
+                      MUXDEF(CONFIG_ISA_mips32,  "mipsel", \
+                      MUXDEF(CONFIG_ISA_riscv, \
+                        MUXDEF(CONFIG_RV64,      "riscv64", \
+                                                 "riscv32"), \
+                                                 "bad"))) "-pc-linux-gnu"
+#else
+#define DISASM_TRIPLE "" // the upstream llvm does not support loongarch32r
+#endif
 
 static void welcome() {
   Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -38,12 +58,27 @@ static void welcome() {
 
 #ifndef CONFIG_TARGET_AM
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 void sdb_set_batch_mode();
+long load_elf(int fd);
+void load_elf_symbols(int fd);
 
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+static char *btrace_file = NULL;
+static char *ftrace_file = NULL;
+static char *prof_file = NULL;
+static char *imix_file = NULL;
+static char *bbv_file = NULL;
+static char *restore_file = NULL;
+static char *checkpoint_arg = NULL;
+static char *sample_arg = NULL;
+static char *sample_len = NULL;
+static char *sample_jobs = NULL;
+static char *sample_ckpt = NULL;
 static int difftest_port = 1234;
 
 static long load_img() {
@@ -52,20 +87,25 @@ static long load_img() {
     return 4096; // built-in image size
   }
 
-  FILE *fp = fopen(img_file, "rb");
-  Assert(fp, "Can not open '%s'", img_file);
+  int fd = open(img_file, O_RDONLY);
+  Assert(fd >= 0, "Can not open '%s'", img_file);
 
-  fseek(fp, 0, SEEK_END);
-  long size = ftell(fp);
+  long size = lseek(fd, 0, SEEK_END);
 
   Log("The image is %s, size = %ld", img_file, size);
 
-  fseek(fp, 0, SEEK_SET);
-  int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
-  assert(ret == 1);
+  // an ELF file is loaded by its segments, otherwise it is a raw binary
+  long img_size = load_elf(fd);
+  if (img_size < 0) {
+    paddr_load_file(RESET_VECTOR, size, fd, 0);
+    img_size = size;
+  } else {
+    IFDEF(CONFIG_SYMTAB, load_elf_symbols(fd));
+  }
 
-  fclose(fp);
-  return size;
+  // the mappings of the file stay after it is closed
+  close(fd);
+  return img_size;
 }
 
 static int parse_args(int argc, char *argv[]) {
@@ -74,16 +114,44 @@ static int parse_args(int argc, char *argv[]) {
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"trace"    , required_argument, NULL, 't'},
+    {"trace-window", required_argument, NULL, 'W'},
+    {"trace-pc" , required_argument, NULL, 'P'},
+    {"ftrace"   , required_argument, NULL, 'f'},
+    {"prof"     , required_argument, NULL, 'R'},
+    {"imix"     , required_argument, NULL, 'M'},
+    {"bbv"      , required_argument, NULL, 'V'},
+    {"restore"  , required_argument, NULL, 'r'},
+    {"checkpoint", required_argument, NULL, 'C'},
+    {"sample"   , required_argument, NULL, 'S'},
+    {"sample-len", required_argument, NULL, 'L'},
+    {"sample-jobs", required_argument, NULL, 'J'},
+    {"sample-ckpt", required_argument, NULL, 'K'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:t:f:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 't': btrace_file = optarg; break;
+      case 'f': ftrace_file = optarg; break;
+      case 'R': prof_file = optarg; break;
+      case 'M': imix_file = optarg; break;
+      case 'V': bbv_file = optarg; break;
+      case 'r': restore_file = optarg; break;
+      case 'C': checkpoint_arg = optarg; break;
+      case 'S': sample_arg = optarg; break;
+      case 'L': sample_len = optarg; break;
+      case 'J': sample_jobs = optarg; break;
+      case 'K': sample_ckpt = optarg; break;
+#ifdef CONFIG_TRACE
+      case 'W': Assert(trace_set_window(optarg), "bad trace window '%s'", optarg); break;
+      case 'P': Assert(trace_add_pc_range(optarg), "bad trace pc range '%s'", optarg); break;
+#endif
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -91,6 +159,20 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-t,--trace=FILE         write the binary trace to FILE\n");
+        printf("\t--trace-window=S,E      trace the S-th to the E-th instructions, or S,+COUNT\n");
+        printf("\t--trace-pc=LO,HI        only trace the pcs in [LO, HI), may be repeated\n");
+        printf("\t-f,--ftrace=FILE        write the call stacks of the function tracer to FILE\n");
+        printf("\t--prof=FILE             write the pc samples of the profiler to FILE\n");
+        printf("\t--imix=FILE             write the dynamic instruction mix to FILE as CSV\n");
+        printf("\t--bbv=FILE              write the basic block vectors for SimPoint to FILE\n");
+        printf("\t--restore=FILE          restore the machine from the checkpoint FILE\n");
+        printf("\t--checkpoint=N,FILE     save a checkpoint to FILE after N instructions,\n");
+        printf("\t                        or +N,FILE for FILE.COUNT every N, ,raw to keep the pages uncompressed\n");
+        printf("\t--sample=S1,S2,...      run the interval at each start in a forked worker, or @FILE\n");
+        printf("\t--sample-len=N          run N instructions in each interval\n");
+        printf("\t--sample-jobs=J         run at most J workers at the same time\n");
+        printf("\t--sample-ckpt=PREFIX    save a checkpoint to PREFIX.START at each start\n");
         printf("\n");
         exit(0);
     }
@@ -125,20 +207,37 @@ void init_monitor(int argc, char *argv[]) {
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
+  /* Restore the machine from a checkpoint, and arm --checkpoint. */
+  IFDEF(CONFIG_CHECKPOINT, init_checkpoint(restore_file, checkpoint_arg));
+
+  /* Fork a worker at the start of each interval to sample. */
+  IFDEF(CONFIG_SAMPLE, init_sample(sample_arg, sample_len, sample_jobs, sample_ckpt));
+
   /* Initialize the simple debugger. */
   init_sdb();
 
 #ifndef CONFIG_ISA_loongarch32r
-  IFDEF(CONFIG_ITRACE, init_disasm(
-    MUXDEF(CONFIG_ISA_x86,     "i686",
-    MUXDEF(CONFIG_ISA_mips32,  "mipsel",
-    MUXDEF(CONFIG_ISA_riscv,
-      MUXDEF(CONFIG_RV64,      "riscv64",
-                               "riscv32"),
-                               "bad"))) "-pc-linux-gnu"
-  ));
+  IFDEF(CONFIG_ITRACE, init_disasm(DISASM_TRIPLE));
 #endif
 
+  /* Let SIGUSR2 turn the trace on and off. */
+  IFDEF(CONFIG_TRACE, init_trace());
+
+  /* Index the functions of the image. */
+  IFDEF(CONFIG_FTRACE, init_ftrace(ftrace_file));
+
+  /* Start the profiler. */
+  IFDEF(CONFIG_PROFILE, init_prof(prof_file));
+
+  /* Count the instructions by pattern. */
+  IFDEF(CONFIG_IMIX, init_imix(imix_file));
+
+  /* Open the basic block vectors. */
+  IFDEF(CONFIG_BBV, init_bbv(bbv_file));
+
+  /* Open the binary trace. */
+  IFDEF(CONFIG_BTRACE, init_btrace(btrace_file, DISASM_TRIPLE));
+
   /* Display welcome message. */
   welcome();
 }
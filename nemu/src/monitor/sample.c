@@ -0,0 +1,288 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#define _GNU_SOURCE  // sched_setaffinity()
+#include <isa.h>
+#include <utils/btrace.h>
+#include <monitor/checkpoint.h>
+#include <monitor/sample.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef CONFIG_SAMPLE
+// The driver fast-forwards the workload, and at the start of each interval
+// forks a worker, which inherits the whole machine, runs the interval on a
+// host core of its own and exits. The driver goes on to the next start at
+// the same time. The results of the workers are kept in shared memory.
+
+typedef struct {
+  uint64_t start;
+  uint64_t nr_inst;
+  uint64_t time;
+  int state;
+  uint32_t halt_ret;
+  vaddr_t pc;
+  int status;  // of waitpid()
+  bool forked, done;
+} SampleResult;
+
+uint64_t sample_next = UINT64_MAX;
+bool sample_worker = false;
+
+static uint64_t *starts = NULL;
+static int nr_start = 0, next_start = 0;
+static uint64_t sample_len = 100000000;
+static int sample_jobs = 0;
+static const char *sample_ckpt = NULL;
+static SampleResult *results = NULL;
+static pid_t *slot_pid = NULL;
+static int *slot_idx = NULL;
+// the host cores allowed, the driver runs on the first one
+static int cpus[CPU_SETSIZE];
+static int nr_cpu = 0;
+static int worker_idx = -1;
+static uint64_t worker_start_time = 0, driver_start_time = 0, ff_time = 0;
+
+extern uint64_t g_nr_guest_inst;
+void sdb_set_batch_mode();
+
+static void pin(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+static void reap(int slot, int flags) {
+  int status;
+  if (slot_pid[slot] <= 0 || waitpid(slot_pid[slot], &status, flags) <= 0) return;
+  results[slot_idx[slot]].status = status;
+  slot_pid[slot] = 0;
+}
+
+// a free slot, wait for a worker to exit when all of them are busy
+static int get_slot() {
+  while (true) {
+    for (int i = 0; i < sample_jobs; i ++) {
+      reap(i, WNOHANG);
+      if (slot_pid[i] == 0) return i;
+    }
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) continue;
+    for (int i = 0; i < sample_jobs; i ++) {
+      if (slot_pid[i] == pid) {
+        results[slot_idx[i]].status = status;
+        slot_pid[i] = 0;
+      }
+    }
+  }
+}
+
+static void fork_worker(int idx) {
+  uint64_t t0 = get_time();
+  int slot = get_slot();
+  ff_time -= get_time() - t0;  // waiting is not fast-forwarding
+  // the buffered output would be written by both
+  fflush(NULL);
+  pid_t pid = fork();
+  Assert(pid >= 0, "fail to fork the worker for the interval at %" PRIu64, starts[idx]);
+  if (pid > 0) {
+    slot_pid[slot] = pid;
+    slot_idx[slot] = idx;
+    results[idx].forked = true;
+    return;
+  }
+
+  sample_worker = true;
+  worker_idx = idx;
+  worker_start_time = get_time();
+  sample_next = starts[idx] + sample_len;
+  pin(cpus[(1 + slot) % nr_cpu]);
+  char suffix[24];
+  sprintf(suffix, ".%" PRIu64, starts[idx]);
+  log_fork(suffix);
+  // the trace file and the checkpoints of --checkpoint belong to the driver
+  IFDEF(CONFIG_BTRACE, btrace_fork());
+  IFDEF(CONFIG_CHECKPOINT, ckpt_next = UINT64_MAX);
+}
+
+// called by cpu_exec() when g_nr_guest_inst reaches sample_next
+void sample_reach() {
+  if (sample_worker) {
+    sample_next = UINT64_MAX;
+    nemu_state.state = NEMU_STOP;
+    return;
+  }
+  int idx = next_start ++;
+  sample_next = (next_start < nr_start ? starts[next_start] : UINT64_MAX);
+#ifdef CONFIG_CHECKPOINT
+  if (sample_ckpt != NULL) {
+    char name[strlen(sample_ckpt) + 24];
+    sprintf(name, "%s.%" PRIu64, sample_ckpt, g_nr_guest_inst);
+    ckpt_save(name, false);
+  }
+#endif
+  fork_worker(idx);
+  // nothing is left to fast-forward
+  if (!sample_worker && next_start == nr_start) {
+    ff_time += get_time() - driver_start_time;
+    nemu_state.state = NEMU_QUIT;
+  }
+}
+
+// called by cpu_exec() in a worker when it stops, it never returns
+void sample_finish() {
+  SampleResult *r = &results[worker_idx];
+  r->nr_inst = g_nr_guest_inst - r->start;
+  r->time = get_time() - worker_start_time;
+  r->state = nemu_state.state;
+  r->halt_ret = nemu_state.halt_ret;
+  r->pc = (nemu_state.state == NEMU_STOP ? cpu.pc : nemu_state.halt_pc);
+  r->done = true;
+  log_flush();
+  fflush(NULL);
+  // the files of the atexit() handlers belong to the driver
+  _exit(0);
+}
+
+static const char *result_str(SampleResult *r) {
+  if (!r->forked) return "not reached";
+  if (!r->done) return (WIFSIGNALED(r->status) ? strsignal(WTERMSIG(r->status)) : "lost");
+  switch (r->state) {
+    case NEMU_STOP: return "done";
+    case NEMU_END: return (r->halt_ret == 0 ? "GOOD TRAP" : "BAD TRAP");
+    case NEMU_QUIT: return "quit";
+    default: return "ABORT";
+  }
+}
+
+static void sample_report() {
+  if (sample_worker) return;
+  if (next_start < nr_start) { ff_time += get_time() - driver_start_time; }
+  for (int i = 0; i < sample_jobs; i ++) { reap(i, 0); }
+  uint64_t wall = get_time() - driver_start_time;
+
+  Log("sampled simulation of %d intervals of %" PRIu64 " instructions with %d workers:",
+      nr_start, sample_len, sample_jobs);
+  _Log("  %16s %14s %12s %10s  %s\n", "start", "instructions", "time (us)", "inst/s", "end");
+  uint64_t total_inst = 0, total_time = 0;
+  for (int i = 0; i < nr_start; i ++) {
+    SampleResult *r = &results[i];
+    total_inst += r->nr_inst;
+    total_time += r->time;
+    char at[32] = "";
+    if (r->done && r->state != NEMU_STOP) { sprintf(at, " at pc = " FMT_WORD, r->pc); }
+    _Log("  %16" PRIu64 " %14" PRIu64 " %12" PRIu64 " %10.0f  %s%s\n", r->start, r->nr_inst, r->time,
+        (r->time > 0 ? r->nr_inst * 1000000.0 / r->time : 0.0), result_str(r), at);
+  }
+  _Log("  %16s %14" PRIu64 " %12" PRIu64 "\n", "total", total_inst, total_time);
+  _Log("fast-forward = %" PRIu64 " us, wall = %" PRIu64 " us, speedup over one by one = %.2f\n",
+      ff_time, wall, (wall > 0 ? (double)(ff_time + total_time) / wall : 0.0));
+  log_flush();
+}
+
+static int start_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static bool add_start(const char *s, char **end) {
+  uint64_t n = strtoull(s, end, 0);
+  if (*end == s) return false;
+  starts = realloc(starts, sizeof(starts[0]) * (nr_start + 1));
+  assert(starts);
+  starts[nr_start ++] = n;
+  return true;
+}
+
+// "S1,S2,..." or "@FILE" with a start on each line, '#' begins a comment
+static bool parse_starts(const char *arg) {
+  if (arg[0] == '@') {
+    FILE *fp = fopen(arg + 1, "r");
+    if (fp == NULL) return false;
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+      char *p = line + strspn(line, " \t");
+      if (*p == '#' || *p == '\n' || *p == '\0') continue;
+      char *end;
+      ok = add_start(p, &end) && (*end == '\0' || strchr(" \t\n#", *end) != NULL);
+    }
+    fclose(fp);
+    return ok;
+  }
+  for (const char *p = arg; ; p ++) {
+    char *end;
+    if (!add_start(p, &end)) return false;
+    p = end;
+    if (*p == '\0') return true;
+    if (*p != ',') return false;
+  }
+}
+
+void init_sample(const char *arg, const char *len, const char *jobs, const char *ckpt) {
+  if (arg == NULL) return;
+  bool ok = parse_starts(arg) && nr_start > 0;
+  Assert(ok, "bad sample starts '%s'", arg);
+  qsort(starts, nr_start, sizeof(starts[0]), start_cmp);
+  int n = 0;
+  for (int i = 0; i < nr_start; i ++) {
+    if (n == 0 || starts[i] != starts[n - 1]) { starts[n ++] = starts[i]; }
+  }
+  nr_start = n;
+  Assert(starts[0] >= g_nr_guest_inst, "the interval at %" PRIu64 " is already passed", starts[0]);
+  if (len != NULL) {
+    char *end;
+    sample_len = strtoull(len, &end, 0);
+    Assert(*end == '\0' && sample_len > 0, "bad sample length '%s'", len);
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int i = 0; i < CPU_SETSIZE; i ++) {
+      if (CPU_ISSET(i, &set)) { cpus[nr_cpu ++] = i; }
+    }
+  }
+  if (nr_cpu == 0) { cpus[nr_cpu ++] = 0; }
+  sample_jobs = (nr_cpu > 1 ? nr_cpu - 1 : 1);
+  if (jobs != NULL) {
+    char *end;
+    sample_jobs = strtol(jobs, &end, 0);
+    Assert(*end == '\0' && sample_jobs > 0, "bad number of sample jobs '%s'", jobs);
+  }
+  sample_ckpt = ckpt;
+
+  results = mmap(NULL, sizeof(results[0]) * nr_start, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  Assert(results != MAP_FAILED, "fail to map the sample results");
+  for (int i = 0; i < nr_start; i ++) { results[i] = (SampleResult){ .start = starts[i] }; }
+  slot_pid = calloc(sample_jobs, sizeof(slot_pid[0]));
+  slot_idx = calloc(sample_jobs, sizeof(slot_idx[0]));
+  assert(slot_pid && slot_idx);
+
+  pin(cpus[0]);
+  sample_next = starts[0];
+  driver_start_time = get_time();
+  // the driver runs to the last start without stopping
+  sdb_set_batch_mode();
+  atexit(sample_report);
+  Log("Sample %d intervals of %" PRIu64 " instructions with %d workers", nr_start, sample_len, sample_jobs);
+}
+#endif
@@ -0,0 +1,475 @@
+/***************************************************************************************
+ * Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+ *
+ * NEMU is licensed under Mulan PSL v2.
+ * You can use this software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *          http://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+ * EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+ * MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ ***************************************************************************************/
+
+#include <isa.h>
+#include <watchpoint.h>
+#include <utils/btrace.h>
+#include <monitor/reverse.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef CONFIG_REVERSE
+// A snapshot is a copy of NEMU forked every CONFIG_REVERSE_PERIOD
+// instructions, which waits on the pipe of its slot and shares the memory
+// copy-on-write. To go back, the running process hands over to the nearest
+// snapshot before the target and exits. The snapshot forks again, so that
+// the child stays in the slot, and runs again to the target itself.
+//
+// The first process stays as the parent seen by the shell. Once it hands
+// over, it only waits for the running process to exit and takes its exit
+// status. As a subreaper, it is also the parent of the orphans, so the
+// process running is its child once the one handing over has exited. It
+// holds the only write end of rev_life, and the snapshots exit at the end
+// of file when it dies.
+
+enum
+{
+  REV_GOTO, // run to the target and stop
+  REV_RC,   // run to the target, and find the last change of a watchpoint
+};
+
+enum
+{
+  REV_NOTE_NONE,
+  REV_NOTE_WATCH,   // stopped at the last change of a watchpoint
+  REV_NOTE_NO_WATCH // no watchpoint changes, stopped at the earliest snapshot
+};
+
+// sent through the pipe of a snapshot, less than PIPE_BUF to be written at once
+typedef struct
+{
+  int mode, note;
+  uint64_t target;
+  int nr_wp;
+  int wp_no[NR_WP];
+  uint32_t wp_addr[NR_WP];
+} RevMsg;
+
+// shared by all the processes
+typedef struct
+{
+  struct
+  {
+    pid_t pid; // 0 if the slot is free
+    uint64_t nr_inst;
+    uint64_t used; // of the clock below, the least recently used is dropped
+  } snap[CONFIG_REVERSE_NR_SNAP];
+  uint64_t clock;
+  pid_t root;
+  pid_t active; // the process running, 0 during a hand over
+  int status;
+  bool exited;
+} RevShared;
+
+uint64_t rev_next = UINT64_MAX;
+static uint64_t rev_snap_next = UINT64_MAX;
+static uint64_t rev_stop = UINT64_MAX;
+static int rev_mode = REV_GOTO, rev_note = REV_NOTE_NONE;
+static uint64_t rev_base = 0, rev_hit = UINT64_MAX;
+static RevShared *rev = NULL;
+static int rev_pipe[CONFIG_REVERSE_NR_SNAP][2];
+static int rev_life[2];
+
+extern uint64_t g_nr_guest_inst;
+int is_exit_status_bad();
+
+static void rev_update_next()
+{
+  rev_next = (rev_snap_next < rev_stop ? rev_snap_next : rev_stop);
+}
+
+// the slot of the latest snapshot at or before `nr_inst`, -1 if none
+static int rev_find(uint64_t nr_inst)
+{
+  int slot = -1;
+  for (int i = 0; i < CONFIG_REVERSE_NR_SNAP; i++)
+  {
+    if (rev->snap[i].pid != 0 && rev->snap[i].nr_inst <= nr_inst &&
+        (slot < 0 || rev->snap[i].nr_inst > rev->snap[slot].nr_inst))
+    {
+      slot = i;
+    }
+  }
+  return slot;
+}
+
+static void rev_drop(int slot)
+{
+  kill(rev->snap[slot].pid, SIGKILL);
+  rev->snap[slot].pid = 0;
+}
+
+// the snapshots after `nr_inst` are not the past any more
+static void rev_drop_after(uint64_t nr_inst)
+{
+  for (int i = 0; i < CONFIG_REVERSE_NR_SNAP; i++)
+  {
+    if (rev->snap[i].pid != 0 && rev->snap[i].nr_inst > nr_inst)
+    {
+      rev_drop(i);
+    }
+  }
+}
+
+static void rev_drop_all()
+{
+  for (int i = 0; i < CONFIG_REVERSE_NR_SNAP; i++)
+  {
+    if (rev->snap[i].pid != 0)
+    {
+      rev_drop(i);
+    }
+  }
+}
+
+static void rev_resume(RevMsg *m)
+{
+  __atomic_store_n(&rev->active, getpid(), __ATOMIC_SEQ_CST);
+  // killed by SIGIO at the end of file of rev_life, when the first process dies
+  fcntl(rev_life[0], F_SETOWN, getpid());
+  fcntl(rev_life[0], F_SETFL, O_ASYNC);
+  log_fork(NULL);
+  IFDEF(CONFIG_BTRACE, btrace_fork());
+  // the watchpoints may be set after the snapshot is taken
+  watchpoint_import(m->wp_no, m->wp_addr, m->nr_wp);
+  rev_mode = m->mode;
+  rev_note = m->note;
+  rev_base = g_nr_guest_inst;
+  rev_hit = UINT64_MAX;
+  rev_stop = m->target;
+}
+
+// a snapshot waits here until it is resumed, and returns in the process
+// resumed, while its child waits in the slot
+static void rev_freeze(int slot)
+{
+  struct pollfd fds[2] = {
+      {.fd = rev_pipe[slot][0], .events = POLLIN},
+      {.fd = rev_life[0], .events = POLLIN},
+  };
+  RevMsg m;
+  while (true)
+  {
+    int ret = poll(fds, 2, -1);
+    if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (ret < 0 || fds[1].revents != 0)
+    {
+      // the first process is gone
+      _exit(0);
+    }
+    ssize_t len = read(rev_pipe[slot][0], &m, sizeof(m));
+    if (len < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (len != sizeof(m))
+    {
+      _exit(0);
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      continue;
+    }
+    // leave the slot if the fork fails
+    rev->snap[slot].pid = (pid > 0 ? pid : 0);
+    break;
+  }
+  rev_resume(&m);
+}
+
+// return true in the snapshot when it is resumed
+static bool rev_snapshot()
+{
+  int slot = 0;
+  for (int i = 0; i < CONFIG_REVERSE_NR_SNAP; i++)
+  {
+    if (rev->snap[i].pid != 0 && rev->snap[i].nr_inst == g_nr_guest_inst)
+    {
+      // passed again after going back
+      rev->snap[i].used = ++rev->clock;
+      return false;
+    }
+    if (rev->snap[slot].pid != 0 && (rev->snap[i].pid == 0 || rev->snap[i].used < rev->snap[slot].used))
+    {
+      slot = i;
+    }
+  }
+  if (rev->snap[slot].pid != 0)
+  {
+    rev_drop(slot);
+  }
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+  {
+  }
+
+  // the buffered output would be written by both
+  log_flush();
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    return false;
+  }
+  if (pid > 0)
+  {
+    rev->snap[slot].pid = pid;
+    rev->snap[slot].nr_inst = g_nr_guest_inst;
+    rev->snap[slot].used = ++rev->clock;
+    return false;
+  }
+  // only inherited from the first process, -1 in the others
+  close(rev_life[1]);
+  rev_life[1] = -1;
+  rev_freeze(slot);
+  return true;
+}
+
+// the first process waits for the one running, it never returns
+static void rev_supervise()
+{
+  while (true)
+  {
+    pid_t pid = waitpid(-1, NULL, 0);
+    if (pid < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    // the one handing over clears rev->active before it exits
+    if (pid < 0 || pid == __atomic_load_n(&rev->active, __ATOMIC_SEQ_CST))
+    {
+      break;
+    }
+  }
+  // it may have failed before dropping the snapshots
+  rev_drop_all();
+  while (wait(NULL) > 0 || errno == EINTR)
+  {
+  }
+  _exit(rev->exited ? rev->status : 1);
+}
+
+static void rev_handover(int slot, int mode, int note, uint64_t target)
+{
+  RevMsg m = {.mode = mode, .note = note, .target = target};
+  m.nr_wp = watchpoint_export(m.wp_no, m.wp_addr);
+  rev->snap[slot].used = ++rev->clock;
+
+  // the binary trace only holds the instructions before going back
+  IFDEF(CONFIG_BTRACE, btrace_close());
+  log_flush();
+  fflush(NULL);
+  __atomic_store_n(&rev->active, 0, __ATOMIC_SEQ_CST);
+  bool ok = write(rev_pipe[slot][1], &m, sizeof(m)) == sizeof(m);
+  Assert(ok, "fail to resume the snapshot");
+  if (getpid() == rev->root)
+  {
+    rev_supervise();
+  }
+  _exit(0);
+}
+
+// go to `target` from the latest snapshot before it, return false if none
+static bool rev_goto(uint64_t target, int note)
+{
+  int slot = rev_find(target);
+  if (slot < 0)
+  {
+    return false;
+  }
+  rev_handover(slot, REV_GOTO, note, target);
+  return true;
+}
+
+static void rev_arrive()
+{
+  if (rev_mode == REV_GOTO)
+  {
+    rev_drop_after(g_nr_guest_inst);
+    nemu_state.state = NEMU_STOP;
+    if (rev_note == REV_NOTE_WATCH)
+    {
+      printf("Watchpoint changed\n");
+    }
+    else if (rev_note == REV_NOTE_NO_WATCH)
+    {
+      printf("No watchpoint changes before, stop at the earliest snapshot\n");
+    }
+    printf("Back at instruction %" PRIu64 ", pc = " FMT_WORD "\n", g_nr_guest_inst, cpu.pc);
+    rev_mode = REV_GOTO;
+    rev_note = REV_NOTE_NONE;
+    return;
+  }
+
+  // the last change in (rev_base, rev_stop], otherwise look before rev_base
+  if (rev_hit != UINT64_MAX)
+  {
+    rev_goto(rev_hit, REV_NOTE_WATCH);
+  }
+  else
+  {
+    int slot = (rev_base > 0 ? rev_find(rev_base - 1) : -1);
+    if (slot >= 0)
+    {
+      rev_handover(slot, REV_RC, REV_NOTE_NONE, rev_base);
+    }
+    rev_goto(rev_base, REV_NOTE_NO_WATCH);
+  }
+  // the snapshot is dropped in the mean time, just stop here
+  rev_mode = REV_GOTO;
+  nemu_state.state = NEMU_STOP;
+  printf("No snapshot to go back to, stop at instruction %" PRIu64 "\n", g_nr_guest_inst);
+}
+
+// called by cpu_exec() when g_nr_guest_inst reaches rev_next
+bool rev_reach()
+{
+  bool resumed = false;
+  if (g_nr_guest_inst == rev_snap_next)
+  {
+    rev_snap_next += CONFIG_REVERSE_PERIOD;
+    resumed = rev_snapshot();
+  }
+  if (g_nr_guest_inst == rev_stop)
+  {
+    rev_stop = UINT64_MAX;
+    rev_arrive();
+  }
+  rev_update_next();
+  return resumed;
+}
+
+bool rev_watch_hit()
+{
+  // running again to go back, where only the last change matters
+  if (rev_stop == UINT64_MAX)
+  {
+    return false;
+  }
+  rev_hit = g_nr_guest_inst;
+  return true;
+}
+
+void rev_step_back(uint64_t n)
+{
+  if (rev == NULL || n == 0)
+  {
+    return;
+  }
+  uint64_t target = (n > g_nr_guest_inst ? 0 : g_nr_guest_inst - n);
+  if (!rev_goto(target, REV_NOTE_NONE))
+  {
+    printf("No snapshot at or before instruction %" PRIu64 "\n", target);
+  }
+}
+
+void rev_continue()
+{
+  if (rev == NULL || g_nr_guest_inst == 0)
+  {
+    return;
+  }
+  int slot = rev_find(g_nr_guest_inst - 1);
+  if (slot < 0)
+  {
+    printf("No snapshot before instruction %" PRIu64 "\n", g_nr_guest_inst);
+    return;
+  }
+  if (!watchpoint_armed())
+  {
+    // go straight to the earliest one
+    for (int i = 0; i < CONFIG_REVERSE_NR_SNAP; i++)
+    {
+      if (rev->snap[i].pid != 0 && rev->snap[i].nr_inst < rev->snap[slot].nr_inst)
+      {
+        slot = i;
+      }
+    }
+    rev_handover(slot, REV_GOTO, REV_NOTE_NO_WATCH, rev->snap[slot].nr_inst);
+  }
+  rev_handover(slot, REV_RC, REV_NOTE_NONE, g_nr_guest_inst - 1);
+}
+
+void rev_info()
+{
+  if (rev == NULL)
+  {
+    return;
+  }
+  // from the latest one
+  printf("instruction\tpid\n");
+  for (int slot = rev_find(UINT64_MAX); slot >= 0;)
+  {
+    uint64_t nr_inst = rev->snap[slot].nr_inst;
+    printf("%" PRIu64 "\t%d\n", nr_inst, rev->snap[slot].pid);
+    slot = (nr_inst > 0 ? rev_find(nr_inst - 1) : -1);
+  }
+}
+
+// the snapshots are not the past of the machine restored from a checkpoint
+void rev_reset()
+{
+  if (rev == NULL)
+  {
+    return;
+  }
+  rev_drop_all();
+  rev_snap_next = (g_nr_guest_inst + CONFIG_REVERSE_PERIOD - 1) / CONFIG_REVERSE_PERIOD * CONFIG_REVERSE_PERIOD;
+  rev_update_next();
+}
+
+static void rev_exit()
+{
+  if (__atomic_load_n(&rev->active, __ATOMIC_SEQ_CST) != getpid())
+  {
+    return;
+  }
+  rev_drop_all();
+  // the snapshots are the only children
+  while (wait(NULL) > 0 || errno == EINTR)
+  {
+  }
+  rev->status = is_exit_status_bad();
+  rev->exited = true;
+}
+
+void init_reverse()
+{
+  rev = mmap(NULL, sizeof(*rev), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  Assert(rev != MAP_FAILED, "fail to map the snapshot table");
+  for (int i = 0; i < CONFIG_REVERSE_NR_SNAP; i++)
+  {
+    bool ok = pipe(rev_pipe[i]) == 0;
+    Assert(ok, "fail to create the pipes of the snapshots");
+  }
+  bool ok = pipe(rev_life) == 0;
+  Assert(ok, "fail to create the pipes of the snapshots");
+  rev->root = rev->active = getpid();
+  prctl(PR_SET_CHILD_SUBREAPER, 1);
+  atexit(rev_exit);
+  rev_reset();
+  Log("Reverse execution: a snapshot every %d instructions, at most %d kept",
+      CONFIG_REVERSE_PERIOD, CONFIG_REVERSE_NR_SNAP);
+}
+#endif
@@ -15,6 +15,11 @@
 
 #include <isa.h>
 #include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <utils/trace.h>
+#include <utils/prof.h>
+#include <monitor/checkpoint.h>
+#include <monitor/reverse.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "sdb.h"
@@ -33,6 +38,7 @@ static int is_batch_mode = false;
 
 void init_regex();
 void init_wp_pool();
+void init_reverse();
 
 /* We use the `readline' library to provide more flexibility to read from stdin. */
 static char *rl_gets()
@@ -70,7 +76,7 @@ static int cmd_q(char *args)
   }
   static const uint32_t ebreak = 0x00100073;
   cpu.pc = 0x80000000;
-  memcpy(guest_to_host(RESET_VECTOR), &ebreak, 4);
+  paddr_write(RESET_VECTOR, 4, ebreak); // also drops the stale decode cache entry
   cpu_exec(1);
   // -----
   return -1;
@@ -125,6 +131,21 @@ static int cmd_si(char *args)
 // 寄存器信息
 static int cmd_info(char *args)
 {
+#ifdef CONFIG_PROFILE
+  // the hot spots so far
+  if (strcmp(args, "prof") == 0)
+  {
+    prof_report();
+    return 0;
+  }
+#endif
+#ifdef CONFIG_IMIX
+  if (strcmp(args, "imix") == 0)
+  {
+    imix_report();
+    return 0;
+  }
+#endif
   int len = strlen(args);
   if (len > 1)
   {
@@ -139,6 +160,14 @@ static int cmd_info(char *args)
   {
     print_watchpoint();
   }
+  if (args[0] == 'i')
+  {
+    IFDEF(CONFIG_IQUEUE, iqueue_dump());
+  }
+  if (args[0] == 's')
+  {
+    IFDEF(CONFIG_REVERSE, rev_info());
+  }
   return 0;
 }
 
@@ -218,6 +247,110 @@ static int cmd_d(char *args)
   return 1;
 }
 
+#ifdef CONFIG_TRACE
+// trace [on|off|window S,E|pc LO,HI|pc clear]
+static int cmd_trace(char *args)
+{
+  char *arg = (args == NULL ? NULL : strtok(args, " "));
+  char *rest = (arg == NULL ? NULL : strtok(NULL, ""));
+  bool ok = true;
+  if (arg == NULL)
+  {
+  }
+  else if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)
+  {
+    trace_on = (arg[1] == 'n');
+  }
+  else if (strcmp(arg, "window") == 0 && rest != NULL)
+  {
+    ok = trace_set_window(rest);
+  }
+  else if (strcmp(arg, "pc") == 0 && rest != NULL)
+  {
+    if (strcmp(rest, "clear") == 0)
+    {
+      trace_clear_pc_range();
+    }
+    else
+    {
+      ok = trace_add_pc_range(rest);
+    }
+  }
+  else
+  {
+    ok = false;
+  }
+  if (!ok)
+  {
+    printf("Usage: trace [on|off|window START,END|window START,+COUNT|pc LO,HI|pc clear]\n");
+  }
+  trace_display();
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_CHECKPOINT
+// save [-r] FILE
+static int cmd_save(char *args)
+{
+  char *arg = (args == NULL ? NULL : strtok(args, " "));
+  bool raw = (arg != NULL && strcmp(arg, "-r") == 0);
+  if (raw)
+  {
+    arg = strtok(NULL, " ");
+  }
+  if (arg == NULL)
+  {
+    printf("Usage: save [-r] FILE\n");
+    return 0;
+  }
+  ckpt_save(arg, raw);
+  return 0;
+}
+
+// load FILE
+static int cmd_load(char *args)
+{
+  char *arg = (args == NULL ? NULL : strtok(args, " "));
+  if (arg == NULL)
+  {
+    printf("Usage: load FILE\n");
+    return 0;
+  }
+  if (ckpt_restore(arg))
+  {
+    IFDEF(CONFIG_REVERSE, rev_reset());
+  }
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_REVERSE
+// rsi [N]
+static int cmd_rsi(char *args)
+{
+  uint64_t n = 1;
+  if (args != NULL)
+  {
+    char *end;
+    n = strtoull(args, &end, 0);
+    if (end == args)
+    {
+      printf("Usage: rsi [N]\n");
+      return 0;
+    }
+  }
+  rev_step_back(n);
+  return 0;
+}
+
+static int cmd_rc(char *args)
+{
+  rev_continue();
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 // 程序中存在哪些命令
@@ -238,6 +371,17 @@ static struct
     {"p", "Exit NEMU", cmd_p},
     {"w", "Exit NEMU", cmd_w},
     {"d", "Exit NEMU", cmd_d},
+#ifdef CONFIG_TRACE
+    {"trace", "Show or set the trace window and pc filters", cmd_trace},
+#endif
+#ifdef CONFIG_CHECKPOINT
+    {"save", "Save the machine to a checkpoint, -r to map its pages when restored", cmd_save},
+    {"load", "Restore the machine from a checkpoint", cmd_load},
+#endif
+#ifdef CONFIG_REVERSE
+    {"rsi", "Step back N instructions, 1 by default", cmd_rsi},
+    {"rc", "Run back to the last change of a watchpoint", cmd_rc},
+#endif
 };
 
 #define NR_CMD ARRLEN(cmd_table)
@@ -337,4 +481,12 @@ void init_sdb()
 
   /* Initialize the watchpoint pool. */
   init_wp_pool();
+
+#ifdef CONFIG_REVERSE
+  /* Take snapshots to go back to, only an interactive sdb can use them. */
+  if (!is_batch_mode)
+  {
+    init_reverse();
+  }
+#endif
 }
@@ -106,6 +106,46 @@ int watchpoint_val()
   return 0;
 }
 
+// the watchpoints in use, to hand them over to another process
+int watchpoint_export(int *no, uint32_t *addr)
+{
+  int n = 0;
+  for (WP *cur = head; cur != NULL; cur = cur->next)
+  {
+    no[n] = cur->NO;
+    addr[n] = cur->expr_addr;
+    n++;
+  }
+  return n;
+}
+
+// replace the watchpoints in use with those exported, in the same order,
+// their values are taken from the memory now
+void watchpoint_import(const int *no, const uint32_t *addr, int n)
+{
+  init_wp_pool();
+  for (int i = n - 1; i >= 0; i--)
+  {
+    WP *wp = &wp_pool[no[i]];
+    WP **p = &free_;
+    while (*p != wp)
+    {
+      p = &(*p)->next;
+    }
+    *p = wp->next;
+    wp->next = head;
+    head = wp;
+    wp->expr_addr = addr[i];
+    wp->val = *guest_to_host(addr[i]);
+  }
+}
+
+// 是否有监视点在使用
+bool watchpoint_armed()
+{
+  return head != NULL;
+}
+
 // 删除监视点，只是将其从head 转到 free 节点中的值没做改变  用的时候要小心
 int del_watchpoint(int num)
 {
@@ -0,0 +1,109 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <utils/bbv.h>
+
+#ifdef CONFIG_BBV
+// Basic block vectors for SimPoint. Each interval of CONFIG_BBV_INTERVAL
+// instructions is written as a line of
+//   T:id:count :id:count ...
+// where `count' is the number of instructions executed in the basic
+// block `id' during the interval. The blocks are numbered from 1 by their
+// first appearance, and keyed by their start pc.
+
+typedef struct {
+  vaddr_t pc;
+  uint32_t id; // 0 if the slot is empty
+  uint64_t count; // in this interval
+} BBVSlot;
+
+bool bbv_on = false;
+static BBVSlot *slot = NULL;
+static uint64_t nr_slot = 0;
+static uint32_t nr_block = 0;
+static uint64_t nr_inst = 0; // in this interval
+static vaddr_t block_start = 0;
+static FILE *bbv_fp = NULL;
+
+static BBVSlot *bbv_find(vaddr_t pc) {
+  uint64_t h = ((uint64_t)pc * 0x9e3779b97f4a7c15ull) >> 32;
+  for (uint64_t i = h & (nr_slot - 1); ; i = (i + 1) & (nr_slot - 1)) {
+    if (slot[i].id == 0 || slot[i].pc == pc) { return &slot[i]; }
+  }
+}
+
+// keep the table at most half full
+static void bbv_grow() {
+  BBVSlot *old = slot;
+  uint64_t nr_old = nr_slot;
+  nr_slot = (nr_slot == 0 ? 4096 : nr_slot * 2);
+  slot = calloc(nr_slot, sizeof(slot[0]));
+  assert(slot);
+  for (uint64_t i = 0; i < nr_old; i ++) {
+    if (old[i].id != 0) { *bbv_find(old[i].pc) = old[i]; }
+  }
+  free(old);
+}
+
+static void bbv_dump_interval() {
+  if (nr_inst == 0) { return; }
+  fputc('T', bbv_fp);
+  for (uint64_t i = 0; i < nr_slot; i ++) {
+    if (slot[i].count != 0) {
+      fprintf(bbv_fp, ":%u:%" PRIu64 " ", slot[i].id, slot[i].count);
+      slot[i].count = 0;
+    }
+  }
+  fputc('\n', bbv_fp);
+  nr_inst = 0;
+}
+
+static void bbv_count(uint64_t len) {
+  if (2 * nr_block >= nr_slot) { bbv_grow(); }
+  BBVSlot *s = bbv_find(block_start);
+  if (s->id == 0) {
+    s->pc = block_start;
+    s->id = ++ nr_block;
+  }
+  s->count += len;
+  nr_inst += len;
+}
+
+// the block from block_start ends with the control flow instruction at
+// `pc', and the next one starts at `dnpc'
+void bbv_block(vaddr_t pc, vaddr_t dnpc) {
+  // the guest instructions are 4 bytes long
+  bbv_count(pc >= block_start ? (pc - block_start) / 4 + 1 : 1);
+  block_start = dnpc;
+  if (nr_inst >= CONFIG_BBV_INTERVAL) { bbv_dump_interval(); }
+}
+
+static void bbv_close() {
+  // the block running when the guest ends
+  if (cpu.pc > block_start) { bbv_count((cpu.pc - block_start) / 4); }
+  bbv_dump_interval();
+  fclose(bbv_fp);
+}
+
+void init_bbv(const char *file) {
+  if (file == NULL) { return; }
+  bbv_fp = fopen(file, "w");
+  Assert(bbv_fp, "Can not open '%s'", file);
+  block_start = cpu.pc;
+  bbv_on = true;
+  atexit(bbv_close);
+}
+#endif
@@ -0,0 +1,168 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <utils/btrace.h>
+
+#ifdef CONFIG_BTRACE
+#include <btrace-def.h>
+#include <pthread.h>
+#include <stdio_ext.h>
+#include <zlib.h>
+
+// Records are put into one of the two buffers, while a writer thread
+// compresses and writes the other one to the file.
+
+#define BLOCK_SIZE (1 << 20)
+#define RECORD_MAX (2 + 10 * 2 + ITRACE_ILEN_MAX + BTRACE_MAX_MEM * 11)
+
+typedef struct {
+  uint8_t data[BLOCK_SIZE];
+  uint32_t size;
+  uint64_t first_inst, last_inst;
+} BTraceBuf;
+
+bool btrace_on = false;
+static FILE *btrace_fp = NULL;
+static BTraceBuf bufs[2];
+static BTraceBuf *cur = NULL;
+static uint64_t next_inst = 0;
+static vaddr_t next_pc = 0;
+static vaddr_t last_mem = 0;
+
+// the memory accesses of the instruction being executed
+static struct { vaddr_t addr; uint8_t len; } mem[BTRACE_MAX_MEM];
+static int nr_mem = 0;
+static uint64_t mem_inst = 0;
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static BTraceBuf *pending = NULL;  // handed to the writer
+static bool stop = false;
+
+static void write_block(BTraceBuf *b, uint8_t *out, uLong out_size) {
+  uLongf comp_size = out_size;
+  int ret = compress2(out, &comp_size, b->data, b->size, Z_BEST_SPEED);
+  assert(ret == Z_OK);
+  BTraceBlock blk = { .first_inst = b->first_inst, .last_inst = b->last_inst,
+    .raw_size = b->size, .comp_size = comp_size };
+  ret = fwrite(&blk, sizeof(blk), 1, btrace_fp) == 1 && fwrite(out, comp_size, 1, btrace_fp) == 1;
+  Assert(ret, "fail to write the binary trace");
+}
+
+static void *writer_main(void *arg) {
+  uLong out_size = compressBound(BLOCK_SIZE);
+  uint8_t *out = malloc(out_size);
+  assert(out);
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (pending == NULL && !stop) { pthread_cond_wait(&cond, &lock); }
+    if (pending == NULL) break;
+    BTraceBuf *b = pending;
+    pthread_mutex_unlock(&lock);
+    write_block(b, out, out_size);
+    pthread_mutex_lock(&lock);
+    pending = NULL;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+  free(out);
+  return NULL;
+}
+
+// hand the current buffer to the writer once it finishes the other one
+static void flush_buf() {
+  pthread_mutex_lock(&lock);
+  while (pending != NULL) { pthread_cond_wait(&cond, &lock); }
+  if (cur->size > 0) {
+    pending = cur;
+    pthread_cond_broadcast(&cond);
+    cur = (cur == &bufs[0] ? &bufs[1] : &bufs[0]);
+  }
+  pthread_mutex_unlock(&lock);
+  cur->size = 0;
+  next_pc = last_mem = 0;
+}
+
+void btrace_mem(vaddr_t addr, int len, bool is_write) {
+  extern uint64_t g_nr_guest_inst;
+  if (mem_inst != g_nr_guest_inst) { mem_inst = g_nr_guest_inst; nr_mem = 0; }
+  if (nr_mem < BTRACE_MAX_MEM) {
+    mem[nr_mem].addr = addr;
+    mem[nr_mem].len = len | (is_write ? BTRACE_M_WRITE : 0);
+    nr_mem ++;
+  }
+}
+
+void btrace_inst(uint64_t nr_inst, vaddr_t pc, const uint8_t *inst, int ilen) {
+  if (cur->size + RECORD_MAX > BLOCK_SIZE) { flush_buf(); }
+  if (cur->size == 0) { cur->first_inst = nr_inst; next_inst = nr_inst; }
+  cur->last_inst = nr_inst;
+
+  int n = (mem_inst == nr_inst && ISDEF(CONFIG_BTRACE_MEM) ? nr_mem : 0);
+  uint8_t *p = cur->data + cur->size;
+  *p ++ = ilen | (n << 4) | (nr_inst != next_inst ? BTRACE_R_GAP : 0);
+  if (nr_inst != next_inst) { p = btrace_put_varint(p, nr_inst - next_inst); }
+  p = btrace_put_varint(p, btrace_zigzag((int64_t)pc - (int64_t)next_pc));
+  memcpy(p, inst, ilen);
+  p += ilen;
+  for (int i = 0; i < n; i ++) {
+    *p ++ = mem[i].len;
+    p = btrace_put_varint(p, btrace_zigzag((int64_t)mem[i].addr - (int64_t)last_mem));
+    last_mem = mem[i].addr;
+  }
+  cur->size = p - cur->data;
+  next_inst = nr_inst + 1;
+  next_pc = pc + ilen;
+}
+
+void btrace_close() {
+  if (!btrace_on) return;
+  btrace_on = false;
+  flush_buf();
+  pthread_mutex_lock(&lock);
+  stop = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+  fclose(btrace_fp);
+}
+
+void btrace_fork() {
+  if (!btrace_on) return;
+  btrace_on = false;
+  // what is buffered belongs to the parent, do not write it again at exit()
+  __fpurge(btrace_fp);
+}
+
+void init_btrace(const char *file, const char *triple) {
+  if (file == NULL) return;
+  btrace_fp = fopen(file, "wb");
+  Assert(btrace_fp, "Can not open '%s'", file);
+  BTraceHeader h = { .magic = BTRACE_MAGIC, .flags = (ISDEF(CONFIG_BTRACE_MEM) ? BTRACE_F_MEM : 0),
+    .word_size = sizeof(word_t) };
+  strncpy(h.triple, triple, sizeof(h.triple) - 1);
+  int ret = fwrite(&h, sizeof(h), 1, btrace_fp);
+  assert(ret == 1);
+
+  cur = &bufs[0];
+  ret = pthread_create(&writer, NULL, writer_main, NULL);
+  assert(ret == 0);
+  atexit(btrace_close);
+  btrace_on = true;
+  Log("Binary trace is written to %s", file);
+}
+#endif
@@ -22,6 +22,7 @@
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCDisassembler/MCDisassembler.h"
 #include "llvm/MC/MCInstPrinter.h"
+#include "llvm/MC/MCInstrInfo.h"
 #if LLVM_VERSION_MAJOR >= 14
 #include "llvm/MC/TargetRegistry.h"
 #if LLVM_VERSION_MAJOR >= 15
@@ -45,17 +46,30 @@ using namespace llvm;
 static llvm::MCDisassembler *gDisassembler = nullptr;
 static llvm::MCSubtargetInfo *gSTI = nullptr;
 static llvm::MCInstPrinter *gIP = nullptr;
+static llvm::MCInstrInfo *gMII = nullptr;
+static std::string gTriple;
 
-extern "C" void init_disasm(const char *triple) {
-  llvm::InitializeAllTargetInfos();
-  llvm::InitializeAllTargetMCs();
-  llvm::InitializeAllAsmParsers();
-  llvm::InitializeAllDisassemblers();
+// Only the target of the guest is initialized, and only when the first
+// instruction is disassembled. Runs which never print an instruction
+// do not pay for setting up LLVM.
+static void init_target(const llvm::Triple &triple) {
+  std::string prefix = llvm::Triple::getArchTypePrefix(triple.getArch()).str();
+#define LLVM_DISASSEMBLER(t) \
+  if (strcasecmp(prefix.c_str(), #t) == 0) { \
+    LLVMInitialize##t##TargetInfo(); \
+    LLVMInitialize##t##TargetMC(); \
+    LLVMInitialize##t##Disassembler(); \
+    return; \
+  }
+#include "llvm/Config/Disassemblers.def"
+#undef LLVM_DISASSEMBLER
+}
 
+static void setup_disasm() {
   std::string errstr;
-  std::string gTriple(triple);
+  llvm::Triple llvmtriple(gTriple);
+  init_target(llvmtriple);
 
-  llvm::MCInstrInfo *gMII = nullptr;
   llvm::MCRegisterInfo *gMRI = nullptr;
   auto target = llvm::TargetRegistry::lookupTarget(gTriple, errstr);
   if (!target) {
@@ -77,14 +91,12 @@ extern "C" void init_disasm(const char *triple) {
   gMRI = target->createMCRegInfo(gTriple);
   auto AsmInfo = target->createMCAsmInfo(*gMRI, gTriple, MCOptions);
 #if LLVM_VERSION_MAJOR >= 13
-   auto llvmTripleTwine = Twine(triple);
-   auto llvmtriple = llvm::Triple(llvmTripleTwine);
    auto Ctx = new llvm::MCContext(llvmtriple,AsmInfo, gMRI, nullptr);
 #else
    auto Ctx = new llvm::MCContext(AsmInfo, gMRI, nullptr);
 #endif
   gDisassembler = target->createMCDisassembler(*gSTI, *Ctx);
-  gIP = target->createMCInstPrinter(llvm::Triple(gTriple),
+  gIP = target->createMCInstPrinter(llvmtriple,
       AsmInfo->getAssemblerDialect(), *AsmInfo, *gMII, *gMRI);
   gIP->setPrintImmHex(true);
   gIP->setPrintBranchImmAsAddress(true);
@@ -92,7 +104,54 @@ extern "C" void init_disasm(const char *triple) {
     gIP->applyTargetSpecificCLOption("no-aliases");
 }
 
+extern "C" void init_disasm(const char *triple) {
+  gTriple = triple;
+}
+
+// Loops disassemble the same instructions over and over, remember the
+// text of the recent ones. The text of an instruction with a PC-relative
+// operand is only valid at the same pc.
+#define DCACHE_SIZE 4096
+#define DCACHE_CODE_MAX 16
+#define DCACHE_TEXT_MAX 64
+
+struct DCacheEntry {
+  uint64_t pc;
+  uint8_t nbyte;  // 0 if invalid
+  bool pcrel;
+  uint8_t code[DCACHE_CODE_MAX];
+  char text[DCACHE_TEXT_MAX];
+};
+
+static DCacheEntry dcache[DCACHE_SIZE];
+
+static DCacheEntry *dcache_entry(uint8_t *code, int nbyte) {
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < nbyte; i ++) { h = (h ^ code[i]) * 16777619u; }
+  return &dcache[h % DCACHE_SIZE];
+}
+
+static bool is_pcrel(const MCInst &inst) {
+  const llvm::MCInstrDesc &desc = gMII->get(inst.getOpcode());
+  for (const llvm::MCOperandInfo &op : desc.operands()) {
+    if (op.OperandType == llvm::MCOI::OPERAND_PCREL) return true;
+  }
+  return false;
+}
+
 extern "C" void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte) {
+  DCacheEntry *e = nullptr;
+  if (nbyte <= DCACHE_CODE_MAX) {
+    e = dcache_entry(code, nbyte);
+    if (e->nbyte == nbyte && memcmp(e->code, code, nbyte) == 0 && (!e->pcrel || e->pc == pc)) {
+      assert((int)strlen(e->text) < size);
+      strcpy(str, e->text);
+      return;
+    }
+  }
+
+  if (gDisassembler == nullptr) setup_disasm();
+
   MCInst inst;
   llvm::ArrayRef<uint8_t> arr(code, nbyte);
   uint64_t dummy_size = 0;
@@ -106,4 +165,12 @@ extern "C" void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int
   const char *p = s.c_str() + skip;
   assert((int)s.length() - skip < size);
   strcpy(str, p);
+
+  if (e != nullptr && (int)s.length() - skip < DCACHE_TEXT_MAX) {
+    e->pc = pc;
+    e->nbyte = nbyte;
+    e->pcrel = is_pcrel(inst);
+    memcpy(e->code, code, nbyte);
+    strcpy(e->text, p);
+  }
 }
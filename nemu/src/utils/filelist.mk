@@ -13,6 +13,14 @@
 # See the Mulan PSL v2 for more details.
 #**************************************************************************************/
 
+ifdef CONFIG_BTRACE
+LIBS += -lz -lpthread
+endif
+
+ifdef CONFIG_LOG_ASYNC
+LIBS += -lpthread
+endif
+
 ifneq ($(CONFIG_ITRACE)$(CONFIG_IQUEUE),)
 CXXSRC = src/utils/disasm.cc
 CXXFLAGS += $(shell llvm-config --cxxflags) -fPIE
@@ -0,0 +1,117 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <utils/symtab.h>
+#include <utils/ftrace.h>
+
+#ifdef CONFIG_FTRACE
+// the calls deeper than this are not told apart in the folded stacks
+#define FTRACE_DEPTH_MAX 1024
+
+extern uint64_t g_nr_guest_inst;
+
+// a node of the calling context tree, one for each distinct call stack
+typedef struct Frame {
+  int func; // index in symtab[], -1 if unknown
+  uint64_t nr_inst; // instructions executed in it, excluding its callees
+  struct Frame *parent, *child, *sibling;
+} Frame;
+
+static Frame root = { .func = -1 };
+static Frame *cur = &root;
+static int depth = 0; // may go beyond the depth of `cur`
+static uint64_t last_nr_inst = 0;
+static FILE *folded_fp = NULL;
+
+// the instructions since the last call or return are spent in `cur`
+static void charge() {
+  cur->nr_inst += g_nr_guest_inst - last_nr_inst;
+  last_nr_inst = g_nr_guest_inst;
+}
+
+static Frame *enter(Frame *f, int func) {
+  for (Frame **p = &f->child; *p != NULL; p = &(*p)->sibling) {
+    if ((*p)->func == func) {
+      // move it to the front, a hot callee is found at once next time
+      Frame *c = *p;
+      *p = c->sibling;
+      c->sibling = f->child;
+      f->child = c;
+      return c;
+    }
+  }
+  Frame *c = calloc(1, sizeof(Frame));
+  assert(c);
+  c->func = func;
+  c->parent = f;
+  c->sibling = f->child;
+  f->child = c;
+  return c;
+}
+
+void ftrace_call(vaddr_t pc, vaddr_t target) {
+  int func = symtab_lookup(target);
+  log_write(FMT_WORD ": %*scall [%s@" FMT_WORD "]\n", pc, depth * 2, "", symtab_name(func), target);
+  charge();
+  if (depth < FTRACE_DEPTH_MAX) { cur = enter(cur, func); }
+  depth ++;
+}
+
+void ftrace_ret(vaddr_t pc, vaddr_t target) {
+  if (depth == 0) { return; } // returning from where it starts
+  charge();
+  depth --;
+  log_write(FMT_WORD ": %*sret  [%s]\n", pc, depth * 2, "", symtab_name(cur->func));
+  if (depth < FTRACE_DEPTH_MAX) { cur = cur->parent; }
+}
+
+// a jump to the start of another function is a tail call,
+// which takes the place of the current one
+void ftrace_jump(vaddr_t pc, vaddr_t target) {
+  if (cur->func >= 0 && target >= symtab[cur->func].lo && target < symtab[cur->func].hi) { return; }
+  int func = symtab_lookup(target);
+  if (func < 0 || func == cur->func || symtab[func].lo != target || depth == 0) { return; }
+  log_write(FMT_WORD ": %*stail [%s@" FMT_WORD "]\n", pc, (depth - 1) * 2, "", symtab_name(func), target);
+  charge();
+  if (depth <= FTRACE_DEPTH_MAX) { cur = enter(cur->parent, func); }
+}
+
+static void dump_frame(Frame *f, char *path, int len, int size) {
+  int n = snprintf(path + len, size - len, "%s%s", (f == &root ? "" : ";"), symtab_name(f->func));
+  len = (len + n < size ? len + n : size - 1);
+  if (f->nr_inst > 0) { fprintf(folded_fp, "%s %" PRIu64 "\n", path, f->nr_inst); }
+  for (Frame *c = f->child; c != NULL; c = c->sibling) {
+    dump_frame(c, path, len, size);
+  }
+}
+
+// one line for each call stack, with the instructions executed in it
+static void ftrace_dump() {
+  charge();
+  static char path[16384];
+  dump_frame(&root, path, 0, sizeof(path));
+  fclose(folded_fp);
+}
+
+void init_ftrace(const char *folded_file) {
+  root.func = symtab_lookup(cpu.pc);
+  if (folded_file != NULL) {
+    folded_fp = fopen(folded_file, "w");
+    Assert(folded_fp, "Can not open '%s'", folded_file);
+    atexit(ftrace_dump);
+  }
+}
+#endif
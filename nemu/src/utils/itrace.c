@@ -0,0 +1,64 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+
+#ifdef CONFIG_ITRACE
+void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+
+void itrace_format(char *buf, int size, vaddr_t pc, const uint8_t *inst, int ilen) {
+  char *p = buf;
+  p += snprintf(p, size, FMT_WORD ":", pc);
+  for (int i = ilen - 1; i >= 0; i --) {
+    p += snprintf(p, 4, " %02x", inst[i]);
+  }
+  int space_len = ITRACE_ILEN_MAX - ilen;
+  if (space_len < 0) space_len = 0;
+  space_len = space_len * 3 + 1;
+  memset(p, ' ', space_len);
+  p += space_len;
+
+#ifndef CONFIG_ISA_loongarch32r
+  disassemble(p, buf + size - p, MUXDEF(CONFIG_ISA_x86, pc + ilen, pc), (uint8_t *)inst, ilen);
+#else
+  p[0] = '\0'; // the upstream llvm does not support loongarch32r
+#endif
+}
+#endif
+
+#ifdef CONFIG_IQUEUE
+static_assert((CONFIG_IQUEUE_SIZE & (CONFIG_IQUEUE_SIZE - 1)) == 0, "CONFIG_IQUEUE_SIZE should be a power of 2");
+
+IQueueEntry iqueue[CONFIG_IQUEUE_SIZE] = {};
+uint64_t iqueue_nr = 0;
+
+// the last instruction is marked with an arrow
+void iqueue_dump() {
+  uint64_t n = (iqueue_nr < CONFIG_IQUEUE_SIZE ? iqueue_nr : CONFIG_IQUEUE_SIZE);
+  if (n == 0) return;
+  _Log("The last %" PRIu64 " instructions traced:\n", n);
+  for (uint64_t i = iqueue_nr - n; i < iqueue_nr; i ++) {
+    IQueueEntry *e = &iqueue[i & (CONFIG_IQUEUE_SIZE - 1)];
+    char buf[128];
+    if (e->ilen == 0) {
+      // NEMU failed while fetching it
+      snprintf(buf, sizeof(buf), FMT_WORD ": (not fetched)", e->pc);
+    } else {
+      itrace_format(buf, sizeof(buf), e->pc, e->inst, e->ilen);
+    }
+    _Log("%s %s\n", (i == iqueue_nr - 1 ? "-->" : "   "), buf);
+  }
+}
+#endif
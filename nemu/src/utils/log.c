@@ -14,24 +14,219 @@
 ***************************************************************************************/
 
 #include <common.h>
+#include <utils/trace.h>
+#include <stdarg.h>
+#ifdef CONFIG_LOG_ASYNC
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
 
 extern uint64_t g_nr_guest_inst;
 
 #ifndef CONFIG_TARGET_AM
 FILE *log_fp = NULL;
+static const char *log_path = NULL;
+
+#ifdef CONFIG_LOG_ASYNC
+// Log lines are printed into a buffer owned by the calling thread. Full
+// buffers are queued and written to the log file by a flusher thread, so
+// tracing does not wait for a write(2) on every line. The number of
+// buffers is fixed: when all of them are queued, the tracing thread
+// either waits for the flusher or drops its lines.
+
+#define LOG_BUF_SIZE (64 * 1024)
+
+typedef struct LogBuf {
+  struct LogBuf *next;
+  size_t size;
+  char data[LOG_BUF_SIZE];
+} LogBuf;
+
+static LogBuf log_pool[CONFIG_LOG_ASYNC_NR_BUF];
+static LogBuf *free_list = NULL;
+static LogBuf *full_head = NULL, *full_tail = NULL;
+static LogBuf *writing = NULL;
+static __thread LogBuf *cur = NULL;
+static uint64_t nr_drop = 0;
+static bool log_async = false;
+static int log_fd = -1;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+static void write_all(const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(log_fd, p, len);
+    if (ret <= 0) { return; }
+    p += ret;
+    len -= ret;
+  }
+}
+
+static void *log_flusher(void *arg) {
+  pthread_mutex_lock(&log_lock);
+  while (true) {
+    while (full_head == NULL) { pthread_cond_wait(&log_cond, &log_lock); }
+    writing = full_head;
+    full_head = full_head->next;
+    pthread_mutex_unlock(&log_lock);
+
+    write_all(writing->data, writing->size);
+
+    pthread_mutex_lock(&log_lock);
+    writing->next = free_list;
+    free_list = writing;
+    writing = NULL;
+    pthread_cond_broadcast(&log_cond);
+  }
+  return NULL;
+}
+
+// the following two are called with log_lock held
+static void submit_buf(LogBuf *b) {
+  b->next = NULL;
+  if (full_head == NULL) { full_head = b; }
+  else { full_tail->next = b; }
+  full_tail = b;
+  pthread_cond_broadcast(&log_cond);
+}
+
+static LogBuf *get_buf() {
+  while (free_list == NULL) {
+    if (MUXDEF(CONFIG_LOG_ASYNC_DROP, true, false)) { return NULL; }
+    pthread_cond_wait(&log_cond, &log_lock);
+  }
+  LogBuf *b = free_list;
+  free_list = b->next;
+  b->size = 0;
+  return b;
+}
+
+static void next_buf() {
+  pthread_mutex_lock(&log_lock);
+  if (cur != NULL) { submit_buf(cur); }
+  cur = get_buf();
+  pthread_mutex_unlock(&log_lock);
+}
+
+static void log_vprintf(const char *fmt, va_list ap) {
+  if (cur == NULL) {
+    next_buf();
+    if (cur == NULL) { __atomic_add_fetch(&nr_drop, 1, __ATOMIC_RELAXED); return; }
+  }
+  va_list ap2;
+  va_copy(ap2, ap);
+  size_t left = LOG_BUF_SIZE - cur->size;
+  int len = vsnprintf(cur->data + cur->size, left, fmt, ap);
+  if (len >= left) {
+    // start the line again in a new buffer, truncate it if it is still too long
+    next_buf();
+    if (cur == NULL) { __atomic_add_fetch(&nr_drop, 1, __ATOMIC_RELAXED); va_end(ap2); return; }
+    len = vsnprintf(cur->data, LOG_BUF_SIZE, fmt, ap2);
+    if (len >= LOG_BUF_SIZE) { len = LOG_BUF_SIZE - 1; }
+  }
+  va_end(ap2);
+  cur->size += len;
+}
+
+void log_flush() {
+  if (!log_async) { fflush(log_fp); return; }
+  pthread_mutex_lock(&log_lock);
+  if (cur != NULL && cur->size > 0) {
+    submit_buf(cur);
+    cur = NULL;
+  }
+  while (full_head != NULL || writing != NULL) { pthread_cond_wait(&log_cond, &log_lock); }
+  pthread_mutex_unlock(&log_lock);
+}
+
+static void log_exit() {
+  log_flush();
+  if (nr_drop > 0) {
+    fprintf(stderr, "%" PRIu64 " lines are dropped from the log\n", nr_drop);
+  }
+}
+
+// Write out whatever is left without taking the lock, the lock may be
+// held by the interrupted thread. The buffer being written by the flusher
+// may be lost.
+static void log_signal_handler(int sig) {
+  for (LogBuf *b = full_head; b != NULL; b = b->next) {
+    write_all(b->data, b->size);
+  }
+  if (cur != NULL) { write_all(cur->data, cur->size); }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void init_log_async(FILE *fp) {
+  log_fd = fileno(fp);
+  for (int i = 0; i < CONFIG_LOG_ASYNC_NR_BUF; i++) {
+    log_pool[i].next = free_list;
+    free_list = &log_pool[i];
+  }
+  pthread_t t;
+  int ret = pthread_create(&t, NULL, log_flusher, NULL);
+  Assert(ret == 0, "can not create the log flusher thread");
+  pthread_detach(t);
+
+  int sigs[] = { SIGINT, SIGTERM, SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV };
+  for (int i = 0; i < ARRLEN(sigs); i++) {
+    signal(sigs[i], log_signal_handler);
+  }
+  atexit(log_exit);
+  log_async = true;
+}
+#else
+void log_flush() { fflush(log_fp); }
+#endif
+
+void log_printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+#ifdef CONFIG_LOG_ASYNC
+  if (log_async) {
+    log_vprintf(fmt, ap);
+    va_end(ap);
+    return;
+  }
+#endif
+  vfprintf(log_fp, fmt, ap);
+  fflush(log_fp);
+  va_end(ap);
+}
+
+// a forked child writes its log to a file of its own, or goes on with the
+// same file when `suffix` is NULL, and synchronously since the flusher
+// thread is not forked, the buffers queued are left to the parent
+void log_fork(const char *suffix) {
+#ifdef CONFIG_LOG_ASYNC
+  log_async = false;
+  cur = full_head = full_tail = NULL;
+#endif
+  if (log_path == NULL || suffix == NULL) return;
+  char *file = malloc(strlen(log_path) + strlen(suffix) + 1);
+  assert(file);
+  sprintf(file, "%s%s", log_path, suffix);
+  FILE *fp = fopen(file, "w");
+  Assert(fp, "Can not open '%s'", file);
+  log_fp = fp;
+  free(file);
+}
 
 void init_log(const char *log_file) {
   log_fp = stdout;
+  log_path = log_file;
   if (log_file != NULL) {
     FILE *fp = fopen(log_file, "w");
     Assert(fp, "Can not open '%s'", log_file);
     log_fp = fp;
+    IFDEF(CONFIG_LOG_ASYNC, init_log_async(fp));
   }
   Log("Log is written to %s", log_file ? log_file : "stdout");
 }
 
 bool log_enable() {
-  return MUXDEF(CONFIG_TRACE, (g_nr_guest_inst >= CONFIG_TRACE_START) &&
-         (g_nr_guest_inst <= CONFIG_TRACE_END), false);
+  return MUXDEF(CONFIG_TRACE, trace_active(g_nr_guest_inst), false);
 }
 #endif
@@ -0,0 +1,136 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <utils/symtab.h>
+#include <utils/prof.h>
+
+#ifdef CONFIG_PROFILE
+// the number of functions and pcs in a report
+#define PROF_TOP 10
+
+// a hash table from pc to its number of samples, with linear probing
+typedef struct {
+  vaddr_t pc;
+  uint64_t count; // 0 if the slot is empty
+} ProfSlot;
+
+static ProfSlot *slot = NULL;
+static uint64_t nr_slot = 0, nr_used = 0, nr_sample = 0;
+static FILE *folded_fp = NULL;
+
+static ProfSlot *prof_find(vaddr_t pc) {
+  uint64_t h = ((uint64_t)pc * 0x9e3779b97f4a7c15ull) >> 32;
+  for (uint64_t i = h & (nr_slot - 1); ; i = (i + 1) & (nr_slot - 1)) {
+    if (slot[i].count == 0 || slot[i].pc == pc) { return &slot[i]; }
+  }
+}
+
+// keep the table at most half full
+static void prof_grow() {
+  ProfSlot *old = slot;
+  uint64_t nr_old = nr_slot;
+  nr_slot = (nr_slot == 0 ? 4096 : nr_slot * 2);
+  slot = calloc(nr_slot, sizeof(slot[0]));
+  assert(slot);
+  for (uint64_t i = 0; i < nr_old; i ++) {
+    if (old[i].count != 0) { *prof_find(old[i].pc) = old[i]; }
+  }
+  free(old);
+}
+
+void prof_sample(vaddr_t pc) {
+  if (nr_used * 2 >= nr_slot) { prof_grow(); }
+  ProfSlot *s = prof_find(pc);
+  if (s->count == 0) { s->pc = pc; nr_used ++; }
+  s->count ++;
+  nr_sample ++;
+}
+
+static int slot_cmp(const void *a, const void *b) {
+  uint64_t x = ((const ProfSlot *)a)->count, y = ((const ProfSlot *)b)->count;
+  return (x < y) - (x > y);
+}
+
+// the used slots, or the samples summed by function with the pc of its
+// start, sorted from the hottest
+static ProfSlot *prof_collect(bool by_func, uint64_t *nr) {
+  ProfSlot *ret = malloc(sizeof(ret[0]) * (nr_used + 1));
+  assert(ret);
+  uint64_t n = 0;
+  for (uint64_t i = 0; i < nr_slot; i ++) {
+    if (slot[i].count != 0) { ret[n ++] = slot[i]; }
+  }
+  if (by_func) {
+    uint64_t *func_count = calloc(nr_symtab + 1, sizeof(uint64_t)); // the last one is unknown
+    assert(func_count);
+    for (uint64_t i = 0; i < n; i ++) {
+      int f = symtab_lookup(ret[i].pc);
+      func_count[f >= 0 ? f : nr_symtab] += ret[i].count;
+    }
+    n = 0;
+    for (int f = 0; f <= nr_symtab; f ++) {
+      if (func_count[f] == 0) { continue; }
+      ret[n ++] = (ProfSlot){ .pc = (f < nr_symtab ? symtab[f].lo : 0), .count = func_count[f] };
+    }
+    free(func_count);
+  }
+  qsort(ret, n, sizeof(ret[0]), slot_cmp);
+  *nr = n;
+  return ret;
+}
+
+void prof_report() {
+  if (nr_sample == 0) { return; }
+  _Log("%" PRIu64 " samples, one per %d instructions\n", nr_sample, CONFIG_PROFILE_PERIOD);
+  for (int by_func = 1; by_func >= 0; by_func --) {
+    uint64_t n;
+    ProfSlot *s = prof_collect(by_func, &n);
+    _Log("%s:\n", by_func ? "hottest functions" : "hottest pcs");
+    for (uint64_t i = 0; i < n && i < PROF_TOP; i ++) {
+      int f = symtab_lookup(s[i].pc);
+      double percent = s[i].count * 100.0 / nr_sample;
+      if (by_func) {
+        _Log("  %6.2f%% %10" PRIu64 "  %s\n", percent, s[i].count, f >= 0 ? symtab_name(f) : "??");
+      } else if (f >= 0) {
+        _Log("  %6.2f%% %10" PRIu64 "  " FMT_WORD " %s+%#lx\n", percent, s[i].count, s[i].pc,
+            symtab_name(f), (long)(s[i].pc - symtab[f].lo));
+      } else {
+        _Log("  %6.2f%% %10" PRIu64 "  " FMT_WORD "\n", percent, s[i].count, s[i].pc);
+      }
+    }
+    free(s);
+  }
+}
+
+// "function;pc count", flame graph tools show the hot pcs in each function
+static void prof_dump() {
+  uint64_t n;
+  ProfSlot *s = prof_collect(false, &n);
+  for (uint64_t i = 0; i < n; i ++) {
+    fprintf(folded_fp, "%s;" FMT_WORD " %" PRIu64 "\n", symtab_name(symtab_lookup(s[i].pc)), s[i].pc, s[i].count);
+  }
+  free(s);
+  fclose(folded_fp);
+}
+
+void init_prof(const char *folded_file) {
+  if (folded_file != NULL) {
+    folded_fp = fopen(folded_file, "w");
+    Assert(folded_fp, "Can not open '%s'", folded_file);
+    atexit(prof_dump);
+  }
+}
+#endif
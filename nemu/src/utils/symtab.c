@@ -0,0 +1,68 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <utils/symtab.h>
+
+#ifdef CONFIG_SYMTAB
+FuncSym *symtab = NULL;
+int nr_symtab = 0;
+static int symtab_cap = 0;
+
+void symtab_add(vaddr_t addr, word_t size, const char *name) {
+  if (nr_symtab == symtab_cap) {
+    symtab_cap = (symtab_cap == 0 ? 256 : symtab_cap * 2);
+    symtab = realloc(symtab, sizeof(symtab[0]) * symtab_cap);
+    assert(symtab);
+  }
+  symtab[nr_symtab ++] = (FuncSym){ .lo = addr, .hi = addr + size, .name = strdup(name) };
+}
+
+static int symtab_cmp(const void *a, const void *b) {
+  vaddr_t x = ((const FuncSym *)a)->lo, y = ((const FuncSym *)b)->lo;
+  return (x > y) - (x < y);
+}
+
+// sort the symbols into disjoint intervals for the binary search,
+// a symbol without a size extends to the next one
+void symtab_build() {
+  qsort(symtab, nr_symtab, sizeof(symtab[0]), symtab_cmp);
+  int n = 0;
+  for (int i = 0; i < nr_symtab; i ++) {
+    if (n > 0 && symtab[n - 1].lo == symtab[i].lo) { free(symtab[i].name); continue; } // an alias
+    symtab[n ++] = symtab[i];
+  }
+  nr_symtab = n;
+  for (int i = 0; i < nr_symtab; i ++) {
+    vaddr_t next = (i + 1 < nr_symtab ? symtab[i + 1].lo : (vaddr_t)-1);
+    if (symtab[i].hi == symtab[i].lo || symtab[i].hi > next) { symtab[i].hi = next; }
+  }
+  Log("%d functions in the symbol table", nr_symtab);
+}
+
+int symtab_lookup(vaddr_t pc) {
+  int l = 0, r = nr_symtab - 1, ret = -1;
+  while (l <= r) {
+    int m = (l + r) / 2;
+    if (symtab[m].lo <= pc) { ret = m; l = m + 1; }
+    else { r = m - 1; }
+  }
+  return (ret >= 0 && pc < symtab[ret].hi ? ret : -1);
+}
+
+const char *symtab_name(int func) {
+  return (func >= 0 ? symtab[func].name : "??");
+}
+#endif
@@ -44,6 +44,10 @@ uint64_t get_time() {
   return now - boot_time;
 }
 
+void set_time(uint64_t us) {
+  boot_time = get_time_internal() - us;
+}
+
 void init_rand() {
   srand(get_time_internal());
 }
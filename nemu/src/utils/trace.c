@@ -0,0 +1,136 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <utils/trace.h>
+#ifndef CONFIG_TARGET_AM
+#include <signal.h>
+#endif
+
+#ifdef CONFIG_TRACE
+#define TRACE_NR_RANGE 16
+// the window and the switch are checked again at least once per this many
+// instructions, so that SIGUSR2 is noticed in a long run
+#define TRACE_CHECK_PERIOD (1ull << 20)
+
+volatile bool trace_on = true;
+uint64_t trace_start = CONFIG_TRACE_START;
+uint64_t trace_end = CONFIG_TRACE_END;
+
+static struct {
+  vaddr_t lo, hi;
+} pc_range[TRACE_NR_RANGE];
+static int nr_pc_range = 0;
+
+TraceBlock trace_block = { .lo = 0, .hi = (vaddr_t)-1, .ok = true };
+
+uint64_t trace_next_edge(uint64_t nr_inst, bool *active) {
+  // the next instruction is counted as nr_inst + 1
+  uint64_t next = nr_inst + 1;
+  uint64_t n = TRACE_CHECK_PERIOD;
+  *active = trace_active(next);
+  if (trace_on) {
+    if (next < trace_start) { n = trace_start - next; }
+    else if (next <= trace_end && trace_end - next + 1 < n) { n = trace_end - next + 1; }
+  }
+  return (n < TRACE_CHECK_PERIOD ? n : TRACE_CHECK_PERIOD);
+}
+
+// find the largest interval around `pc` which no range starts or ends in
+bool trace_pc_lookup(vaddr_t pc) {
+  vaddr_t lo = 0, hi = (vaddr_t)-1;
+  bool ok = (nr_pc_range == 0);
+  for (int i = 0; i < nr_pc_range; i ++) {
+    vaddr_t edge[2] = { pc_range[i].lo, pc_range[i].hi };
+    for (int j = 0; j < 2; j ++) {
+      if (edge[j] <= pc) { if (edge[j] > lo) lo = edge[j]; }
+      else if (edge[j] - 1 < hi) { hi = edge[j] - 1; }
+    }
+    if (pc >= pc_range[i].lo && pc < pc_range[i].hi) { ok = true; }
+  }
+  trace_block.lo = lo;
+  trace_block.hi = hi;
+  trace_block.ok = ok;
+  return ok;
+}
+
+// make the next check look up the filters again
+static void trace_block_reset() {
+  trace_block.lo = 1;
+  trace_block.hi = 0;
+}
+
+static bool parse_pair(const char *arg, uint64_t *a, uint64_t *b, bool *relative) {
+  char *end;
+  *a = strtoull(arg, &end, 0);
+  if (end == arg || (*end != ',' && *end != ' ')) return false;
+  arg = end + 1;
+  while (*arg == ' ') arg ++;
+  *relative = (*arg == '+');
+  if (*relative) arg ++;
+  *b = strtoull(arg, &end, 0);
+  return end != arg && *end == '\0';
+}
+
+bool trace_set_window(const char *arg) {
+  uint64_t start, end;
+  bool relative;
+  if (!parse_pair(arg, &start, &end, &relative)) return false;
+  if (relative) {
+    if (end == 0) return false;
+    end = start + end - 1;
+  }
+  if (end < start) return false;
+  trace_start = start;
+  trace_end = end;
+  return true;
+}
+
+bool trace_add_pc_range(const char *arg) {
+  uint64_t lo, hi;
+  bool relative;
+  if (!parse_pair(arg, &lo, &hi, &relative)) return false;
+  if (relative) hi += lo;
+  if (hi <= lo || nr_pc_range == TRACE_NR_RANGE) return false;
+  pc_range[nr_pc_range].lo = lo;
+  pc_range[nr_pc_range].hi = hi;
+  nr_pc_range ++;
+  trace_block_reset();
+  return true;
+}
+
+void trace_clear_pc_range() {
+  nr_pc_range = 0;
+  trace_block_reset();
+}
+
+void trace_display() {
+  printf("trace is %s, window = [%" PRIu64 ", %" PRIu64 "]\n",
+      trace_on ? "on" : "off", trace_start, trace_end);
+  for (int i = 0; i < nr_pc_range; i ++) {
+    printf("pc in [" FMT_WORD ", " FMT_WORD ")\n", pc_range[i].lo, pc_range[i].hi);
+  }
+}
+
+#ifndef CONFIG_TARGET_AM
+static void trace_toggle(int sig) {
+  trace_on = !trace_on;
+}
+
+void init_trace() {
+  signal(SIGUSR2, trace_toggle);
+}
+#endif
+#endif
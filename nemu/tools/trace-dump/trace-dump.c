@@ -0,0 +1,154 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+// Decode the binary trace written by NEMU with CONFIG_BTRACE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <getopt.h>
+#include <zlib.h>
+#include <btrace-def.h>
+
+void init_disasm(const char *triple);
+void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+
+static bool disasm = false;
+static uint64_t pc_lo = 0, pc_hi = UINT64_MAX;
+static uint64_t inst_lo = 0, inst_hi = UINT64_MAX;
+static BTraceHeader h;
+
+// parse "LO-HI", "LO-" or "LO" into an inclusive range
+static void parse_range(const char *s, uint64_t *lo, uint64_t *hi) {
+  char *end;
+  *lo = strtoull(s, &end, 0);
+  if (*end == '\0') { *hi = *lo; return; }
+  if (*end != '-') { fprintf(stderr, "invalid range '%s'\n", s); exit(1); }
+  *hi = (end[1] == '\0' ? UINT64_MAX : strtoull(end + 1, NULL, 0));
+}
+
+static void print_record(uint64_t idx, uint64_t pc, const uint8_t *inst, int ilen,
+    const uint8_t *mem_len, const uint64_t *mem_addr, int nr_mem) {
+  int w = h.word_size * 2;
+  printf("%12" PRIu64 "  0x%0*" PRIx64 ":", idx, w, pc);
+  for (int i = ilen - 1; i >= 0; i --) { printf(" %02x", inst[i]); }
+  if (disasm) {
+    char buf[128];
+    disassemble(buf, sizeof(buf), pc, (uint8_t *)inst, ilen);
+    printf("  %-*s", (nr_mem > 0 ? 32 : 0), buf);
+  }
+  for (int i = 0; i < nr_mem; i ++) {
+    printf("  %c%d 0x%0*" PRIx64, (mem_len[i] & BTRACE_M_WRITE ? 'W' : 'R'),
+        mem_len[i] & ~BTRACE_M_WRITE, w, mem_addr[i]);
+  }
+  putchar('\n');
+}
+
+static void decode_block(const BTraceBlock *b, const uint8_t *p) {
+  const uint8_t *end = p + b->raw_size;
+  uint64_t idx = b->first_inst, pc = 0, last_mem = 0;
+  uint64_t mask = (h.word_size == 8 ? UINT64_MAX : UINT32_MAX);
+  while (p < end) {
+    uint8_t tag = *p ++;
+    int ilen = tag & 0xf, nr_mem = (tag >> 4) & 0x7;
+    uint64_t v;
+    if (tag & BTRACE_R_GAP) { p = btrace_get_varint(p, &v); idx += v; }
+    p = btrace_get_varint(p, &v);
+    pc = (pc + btrace_unzigzag(v)) & mask;
+    const uint8_t *inst = p;
+    p += ilen;
+    uint8_t mem_len[BTRACE_MAX_MEM];
+    uint64_t mem_addr[BTRACE_MAX_MEM];
+    for (int i = 0; i < nr_mem; i ++) {
+      mem_len[i] = *p ++;
+      p = btrace_get_varint(p, &v);
+      last_mem = mem_addr[i] = (last_mem + btrace_unzigzag(v)) & mask;
+    }
+    if (idx >= inst_lo && idx <= inst_hi && pc >= pc_lo && pc <= pc_hi) {
+      print_record(idx, pc, inst, ilen, mem_len, mem_addr, nr_mem);
+    }
+    pc += ilen;
+    idx ++;
+  }
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [OPTION...] TRACE\n\n", prog);
+  printf("\t-d,--disasm             disassemble the instructions\n");
+  printf("\t-p,--pc=LO[-HI]         only print the instructions with pc in [LO, HI]\n");
+  printf("\t-i,--inst=FIRST[-LAST]  only print the instructions with index in [FIRST, LAST]\n");
+  printf("\n");
+  exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  const struct option table[] = {
+    {"disasm", no_argument      , NULL, 'd'},
+    {"pc"    , required_argument, NULL, 'p'},
+    {"inst"  , required_argument, NULL, 'i'},
+    {"help"  , no_argument      , NULL, 'h'},
+    {0       , 0                , NULL,  0 },
+  };
+  int o;
+  while ((o = getopt_long(argc, argv, "dp:i:h", table, NULL)) != -1) {
+    switch (o) {
+      case 'd': disasm = true; break;
+      case 'p': parse_range(optarg, &pc_lo, &pc_hi); break;
+      case 'i': parse_range(optarg, &inst_lo, &inst_hi); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) { usage(argv[0]); }
+
+  FILE *fp = fopen(argv[optind], "rb");
+  if (fp == NULL) { perror(argv[optind]); return 1; }
+  if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, BTRACE_MAGIC, sizeof(h.magic)) != 0) {
+    fprintf(stderr, "%s is not a binary trace of NEMU\n", argv[optind]);
+    return 1;
+  }
+  if (disasm) {
+    if (h.triple[0] == '\0') { fprintf(stderr, "the trace can not be disassembled\n"); return 1; }
+    init_disasm(h.triple);
+  }
+
+  uint8_t *comp = NULL, *raw = NULL;
+  BTraceBlock b;
+  while (fread(&b, sizeof(b), 1, fp) == 1) {
+    // blocks are in order, skip the whole one without decompressing it
+    if (b.first_inst > inst_hi) { break; }
+    if (b.last_inst < inst_lo) {
+      fseek(fp, b.comp_size, SEEK_CUR);
+      continue;
+    }
+    comp = realloc(comp, b.comp_size);
+    raw = realloc(raw, b.raw_size);
+    assert(comp && raw);
+    if (fread(comp, b.comp_size, 1, fp) != 1) { fprintf(stderr, "the trace is truncated\n"); return 1; }
+    uLongf raw_size = b.raw_size;
+    if (uncompress(raw, &raw_size, comp, b.comp_size) != Z_OK || raw_size != b.raw_size) {
+      fprintf(stderr, "the block of instruction %" PRIu64 " is corrupted\n", b.first_inst);
+      return 1;
+    }
+    decode_block(&b, raw);
+  }
+
+  free(comp);
+  free(raw);
+  fclose(fp);
+  return 0;
+}